@@ -0,0 +1,311 @@
+/* glkbench.c: Benchmarks
+        for GlkTerm, curses.h implementation of the Glk API.
+    Designed by Andrew Plotkin <erkyrath@eblong.com>
+    http://www.eblong.com/zarf/glk/index.html
+
+    This is a Glk program which times parts of the library. It is linked
+    with libglkterm.a, but it also reaches into the library's own headers,
+    so that it can count what is sent to the screen backend. See the
+    Makefile in this directory for how each benchmark is run. The
+    results are printed to standard error.
+*/
+
+#include "gtoption.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curses.h>
+#include "glk.h"
+#include "glkstart.h"
+#include "glkterm.h"
+#include "gtscreen.h"
+
+/* How many keys bench_fill() types. */
+#define KEY_COUNT (20000)
+/* How long bench_timer() runs, in milliseconds. */
+#define TIMER_DURATION (3500)
+
+static int redraw_count = 0;
+static int fill_count = 0;
+static int timer_interval = 0;
+static int timer_load = 0;
+
+glkunix_argumentlist_t glkunix_arguments[] = {
+    { "-redraw", glkunix_arg_NumberValue, "-redraw NUM: repaint the whole screen NUM times, and count the backend calls" },
+    { "-fill", glkunix_arg_NumberValue, "-fill NUM: print NUM paragraphs, then time keystrokes in line input" },
+    { "-timer", glkunix_arg_NumberValue, "-timer NUM: request timer events every NUM milliseconds, and see how late they arrive" },
+    { "-load", glkunix_arg_NumberValue, "-load NUM: print NUM paragraphs on each timer event" },
+    { NULL, glkunix_arg_End, NULL }
+};
+
+int glkunix_startup_code(glkunix_startup_t *data)
+{
+    int ix;
+
+    for (ix=1; ix<data->argc; ix++) {
+        if (!strcmp(data->argv[ix], "-redraw") && ix+1 < data->argc) {
+            ix++;
+            redraw_count = atoi(data->argv[ix]);
+        }
+        else if (!strcmp(data->argv[ix], "-fill") && ix+1 < data->argc) {
+            ix++;
+            fill_count = atoi(data->argv[ix]);
+        }
+        else if (!strcmp(data->argv[ix], "-timer") && ix+1 < data->argc) {
+            ix++;
+            timer_interval = atoi(data->argv[ix]);
+        }
+        else if (!strcmp(data->argv[ix], "-load") && ix+1 < data->argc) {
+            ix++;
+            timer_load = atoi(data->argv[ix]);
+        }
+    }
+
+    return TRUE;
+}
+
+/* ---- Counting the screen backend calls. ---- */
+
+/* The counting backend passes every call on to the real one. */
+static screen_t *real_screen = NULL;
+static screen_t counting_screen;
+
+static long count_calls = 0; /* Drawing calls of any kind. */
+static long count_attrs = 0; /* set_attr() calls. */
+static long count_strings = 0; /* put_char() and put_string() calls. */
+static long count_chars = 0; /* Characters sent by those. */
+
+static void count_set_pos(int ypos, int xpos)
+{
+    count_calls++;
+    (*real_screen->set_pos)(ypos, xpos);
+}
+
+static void count_set_attr(chtype attr)
+{
+    count_calls++;
+    count_attrs++;
+    (*real_screen->set_attr)(attr);
+}
+
+static void count_put_char(int ch)
+{
+    count_calls++;
+    count_strings++;
+    count_chars++;
+    (*real_screen->put_char)(ch);
+}
+
+static void count_put_string(char *str, int len)
+{
+    count_calls++;
+    count_strings++;
+    count_chars += len;
+    (*real_screen->put_string)(str, len);
+}
+
+static void count_put_spaces(int len)
+{
+    count_calls++;
+    (*real_screen->put_spaces)(len);
+}
+
+static void count_clear_eol()
+{
+    count_calls++;
+    (*real_screen->clear_eol)();
+}
+
+static void count_clear_all()
+{
+    count_calls++;
+    (*real_screen->clear_all)();
+}
+
+static void count_scroll(int top, int bottom, int delta)
+{
+    count_calls++;
+    (*real_screen->scroll)(top, bottom, delta);
+}
+
+static void start_counting()
+{
+    real_screen = gli_screen;
+    counting_screen = *real_screen;
+    counting_screen.set_pos = &count_set_pos;
+    counting_screen.set_attr = &count_set_attr;
+    counting_screen.put_char = &count_put_char;
+    counting_screen.put_string = &count_put_string;
+    counting_screen.put_spaces = &count_put_spaces;
+    counting_screen.clear_eol = &count_clear_eol;
+    counting_screen.clear_all = &count_clear_all;
+    counting_screen.scroll = &count_scroll;
+    gli_screen = &counting_screen;
+}
+
+/* ---- Utilities. ---- */
+
+/* Microseconds from tv1 to tv2. */
+static double microsec_between(glktimeval_t *tv1, glktimeval_t *tv2)
+{
+    return ((double)tv2->low_sec - (double)tv1->low_sec) * 1000000.0
+        + (double)(tv2->microsec - tv1->microsec);
+}
+
+/* Print some paragraphs which change style every few words. */
+static void fill_window(winid_t win, int count)
+{
+    int ix;
+
+    glk_set_window(win);
+    for (ix=0; ix<count; ix++) {
+        glk_set_style(style_Normal);
+        glk_put_string("The quick brown fox ");
+        glk_set_style(style_Emphasized);
+        glk_put_string("jumps over");
+        glk_set_style(style_Normal);
+        glk_put_string(" the lazy dog, which ");
+        glk_set_style(style_Alert);
+        glk_put_string("does not");
+        glk_set_style(style_Normal);
+        glk_put_string(" get up. Paragraph number ");
+        glk_set_style(style_Subheader);
+        glk_put_string("one of many");
+        glk_set_style(style_Normal);
+        glk_put_string(".\n");
+    }
+}
+
+/* ---- The benchmarks. ---- */
+
+/* Repaint the whole screen, as ctrl-L does, and count the calls that
+    make it to the screen backend. */
+static void bench_redraw(int count)
+{
+    winid_t mainwin, statuswin;
+    glktimeval_t tv1, tv2;
+    int ix;
+
+    mainwin = glk_window_open(0, 0, 0, wintype_TextBuffer, 1);
+    statuswin = glk_window_open(mainwin, winmethod_Above | winmethod_Fixed,
+        3, wintype_TextGrid, 2);
+    fill_window(mainwin, 40);
+    glk_set_window(statuswin);
+    glk_set_style(style_Normal);
+    glk_put_string("Status line: ");
+    glk_set_style(style_Emphasized);
+    glk_put_string("location");
+    glk_set_style(style_Normal);
+    glk_put_string(", score 0, moves 0");
+    gli_windows_update();
+
+    start_counting();
+    glk_current_time(&tv1);
+    for (ix=0; ix<count; ix++)
+        gcmd_win_refresh(NULL, 0);
+    glk_current_time(&tv2);
+
+    fprintf(stderr, "redraw: %d repaints of %s\n", count, real_screen->name);
+    fprintf(stderr, "  per repaint: %.1f backend calls, %.1f attribute changes, %.1f string calls, %.1f characters\n",
+        (double)count_calls / count, (double)count_attrs / count,
+        (double)count_strings / count, (double)count_chars / count);
+    fprintf(stderr, "  per repaint: %.1f microseconds\n",
+        microsec_between(&tv1, &tv2) / count);
+}
+
+/* Fill a window's scrollback, and then type into a line input request,
+    bringing the screen up to date after every key as glk_select() does
+    when keys arrive one at a time. The time per key should not depend on
+    how much scrollback there is. The keys type thirty characters and
+    then delete them, over and over. */
+static void bench_fill(int count)
+{
+    winid_t mainwin;
+    glktimeval_t tv1, tv2;
+    char buf[256];
+    int ix;
+
+    mainwin = glk_window_open(0, 0, 0, wintype_TextBuffer, 1);
+    fill_window(mainwin, count);
+    glk_request_line_event(mainwin, buf, sizeof(buf), 0);
+    gli_windows_set_paging(TRUE);
+    gli_input_guess_focus();
+    gli_windows_update();
+    (*gli_screen->flush)(FALSE);
+
+    glk_current_time(&tv1);
+    for (ix=0; ix<KEY_COUNT; ix++) {
+        gli_input_handle_key(((ix / 30) % 2) ? '\177' : 'x');
+        gli_windows_update();
+        gli_windows_place_cursor();
+        (*gli_screen->flush)(FALSE);
+    }
+    glk_current_time(&tv2);
+
+    glk_cancel_line_event(mainwin, NULL);
+
+    fprintf(stderr, "fill: %d paragraphs of scrollback\n", count);
+    fprintf(stderr, "  per key: %.2f microseconds\n",
+        microsec_between(&tv1, &tv2) / KEY_COUNT);
+}
+
+/* Request timer events, and compare the time each one arrives with the
+    time it was due: the Nth event is due N intervals after the request.
+    If the timer drifts, or drops ticks, the lag grows as it runs. The
+    timer runs for TIMER_DURATION milliseconds of events, and then waits
+    for a key; run it under curses, with a key arriving after that. */
+static void bench_timer(int interval, int load)
+{
+    winid_t mainwin;
+    glktimeval_t tv1, tv2;
+    event_t ev;
+    long count, expected;
+    double lag, totallag, maxlag;
+
+    mainwin = glk_window_open(0, 0, 0, wintype_TextBuffer, 1);
+    glk_set_window(mainwin);
+    glk_put_string("Timing timer events.\n");
+
+    count = 0;
+    expected = TIMER_DURATION / interval;
+    totallag = 0.0;
+    maxlag = 0.0;
+
+    glk_current_time(&tv1);
+    glk_request_timer_events(interval);
+    while (count < expected) {
+        glk_select(&ev);
+        if (ev.type != evtype_Timer)
+            continue;
+        glk_current_time(&tv2);
+        count++;
+        lag = microsec_between(&tv1, &tv2) / 1000.0 
+            - (double)count * interval;
+        totallag += lag;
+        if (lag > maxlag)
+            maxlag = lag;
+        if (load)
+            fill_window(mainwin, load);
+    }
+    glk_request_timer_events(0);
+
+    fprintf(stderr, "timer: every %d msec, %d paragraphs per event\n",
+        interval, load);
+    fprintf(stderr, "  %.1f msec for %ld events (%.1f expected)\n",
+        microsec_between(&tv1, &tv2) / 1000.0, count, 
+        (double)count * interval);
+    fprintf(stderr, "  lag: %.2f msec mean, %.2f msec most, %.2f msec at the end\n",
+        totallag / count, maxlag, lag);
+
+    glk_put_string("Done.\n");
+}
+
+void glk_main(void)
+{
+    if (redraw_count > 0)
+        bench_redraw(redraw_count);
+    if (fill_count > 0)
+        bench_fill(fill_count);
+    if (timer_interval > 0)
+        bench_timer(timer_interval, timer_load);
+}
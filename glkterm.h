@@ -34,6 +34,10 @@ typedef struct grect_struct {
     int right, bottom;
 } grect_t;
 
+#define gli_rect_equal(r1, r2)  \
+    ((r1)->left == (r2)->left && (r1)->top == (r2)->top  \
+    && (r1)->right == (r2)->right && (r1)->bottom == (r2)->bottom)
+
 typedef struct glk_window_struct window_t;
 typedef struct glk_stream_struct stream_t;
 typedef struct glk_fileref_struct fileref_t;
@@ -48,6 +52,7 @@ struct glk_window_struct {
     glui32 type;
     
     grect_t bbox; /* content rectangle, excluding borders */
+    int layoutdamage; /* laid out anew since it was last drawn */
     window_t *parent; /* pair window which contains this one */
     void *data; /* one of the window_*_t structures */
     
@@ -191,8 +196,25 @@ extern int pref_reverse_textgrids;
 extern int pref_override_window_borders;
 extern int pref_window_borders;
 extern int pref_precise_timing;
+extern int pref_max_refresh;
+extern int pref_resize_delay;
 extern int pref_historylen;
+extern char *pref_historyfile;
+extern char *pref_recordfile;
+extern char *pref_replayfile;
+extern int pref_scrollback;
+extern int pref_lazy_layout;
+#ifdef OPT_LAYOUT_THREADS
+extern int pref_layout_threads;
+#endif /* OPT_LAYOUT_THREADS */
+#ifdef OPT_SCROLLBACK_SPILL
+extern int pref_scrollback_spill;
+#endif /* OPT_SCROLLBACK_SPILL */
 extern int pref_prompt_defaults;
+extern int pref_headless;
+#ifdef OPT_DIRECT_SCREEN
+extern int pref_direct_screen;
+#endif /* OPT_DIRECT_SCREEN */
 
 /* Declarations of library internal functions. */
 
@@ -208,29 +230,40 @@ extern int gli_msgin_getchar(char *prompt, int hilite);
 
 extern void gli_initialize_events(void);
 extern void gli_event_store(glui32 type, window_t *win, glui32 val1, glui32 val2);
+extern void gli_event_forget_window(window_t *win);
 extern void gli_set_halfdelay(void);
+extern void gli_event_wake(void);
+#ifdef OPT_TIMED_INPUT
+extern glui32 gli_current_msec(void);
+#endif /* OPT_TIMED_INPUT */
+
+extern int gli_initialize_record(char *progname);
+extern void gli_record_line(window_t *win, void *buf, int unicode, glui32 len);
+extern void gli_record_delivered(event_t *event, int polled);
+extern int gli_replay_event(int polled);
 
 extern void gli_input_handle_key(int key);
 extern void gli_input_guess_focus(void);
 extern glui32 gli_input_from_native(int key);
 
 extern void gli_initialize_windows(void);
-extern void gli_setup_curses(void);
 extern void gli_fast_exit(void);
 extern window_t *gli_new_window(glui32 type, glui32 rock);
 extern void gli_delete_window(window_t *win);
 extern window_t *gli_window_iterate_treeorder(window_t *win);
 extern void gli_window_rearrange(window_t *win, grect_t *box);
 extern void gli_window_redraw(window_t *win);
+extern void gli_window_redraw_damaged(window_t *win);
 extern void gli_windows_redraw(void);
 extern void gli_windows_update(void);
 extern void gli_windows_size_change(void);
 extern void gli_windows_place_cursor(void);
 extern void gli_windows_set_paging(int forcetoend);
 extern void gli_windows_trim_buffers(void);
+extern int gli_windows_idle_work(void);
 extern void gli_window_put_char(window_t *win, char ch);
+extern void gli_window_put_buffer(window_t *win, char *buf, glui32 len);
 extern void gli_windows_unechostream(stream_t *str);
-extern void gli_print_spaces(int len);
 
 extern void gcmd_win_change_focus(window_t *win, glui32 arg);
 extern void gcmd_win_refresh(window_t *win, glui32 arg);
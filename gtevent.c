@@ -5,21 +5,38 @@
 */
 
 #include "gtoption.h"
+#ifdef OPT_TIMED_INPUT
+#define _POSIX_C_SOURCE (200112L) /* for clock_gettime() */
+#endif /* OPT_TIMED_INPUT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #ifdef OPT_TIMED_INPUT
+#include <time.h>
 #include <sys/time.h>
 #endif /* OPT_TIMED_INPUT */
 
+#if defined(OPT_TIMED_INPUT) && defined(OPT_POLL_INPUT)
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif /* OPT_TIMED_INPUT && OPT_POLL_INPUT */
+
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 
-/* A pointer to the place where the pending glk_select() will store its
-    event. When not inside a glk_select() call, this will be NULL. */
-static event_t *curevent = NULL; 
+/* Events which have occurred, but which glk_select() hasn't returned yet,
+    oldest first. This is a ring buffer: the events are at eventqueue_start
+    and the eventqueue_count-1 places after it. */
+#define EVENTQUEUE_SIZE (64)
+static event_t eventqueue[EVENTQUEUE_SIZE];
+static int eventqueue_start = 0;
+static int eventqueue_count = 0;
+
+static void gli_event_dequeue(event_t *event, int inputtoo);
 
 static int halfdelay_running; /* TRUE if halfdelay() has been called. */
 static glui32 timing_msec; /* The current timed-event request, exactly as
@@ -28,44 +45,120 @@ static glui32 timing_msec; /* The current timed-event request, exactly as
 #ifdef OPT_TIMED_INPUT
 
     /* The time at which the next timed event will occur. This is only valid 
-        if timing_msec is nonzero. */
+        if timing_msec is nonzero. (All these times come from 
+        current_time(), not the time of day.) */
     static struct timeval next_time; 
 
+    /* How many timer events in a row have been delivered late, to catch
+        up with ticks that were missed. This only happens with -precise. */
+    static int timer_missed;
+#define MAX_MISSED_TICKS (10)
+
+    /* The last time the screen was brought up to date. This is only
+        used if pref_max_refresh is nonzero. */
+    static struct timeval last_refresh;
+
+    static void current_time(struct timeval *tv);
+    static int time_after(struct timeval *tv1, struct timeval *tv2);
+    static long millisec_between(struct timeval *tv1, struct timeval *tv2);
     static void add_millisec_to_time(struct timeval *tv, glui32 msec);
+    static int timer_due(void);
+    static int refresh_due(void);
+
+#ifdef OPT_POLL_INPUT
+    /* The signal handlers write a byte into this pipe, so that a
+        glk_select() sleeping in poll() wakes up -- even if the signal
+        arrived just before poll() was called. */
+    static int wake_pipe[2] = { -1, -1 };
+
+    static int next_wakeup(void);
+#endif /* OPT_POLL_INPUT */
 
 #endif /* OPT_TIMED_INPUT */
 
+static int select_key(int wait);
+
+#ifdef OPT_USE_SIGNALS
+#ifdef OPT_WINCHANGED_SIGNAL
+
+#ifdef OPT_TIMED_INPUT
+    /* TRUE if the screen size has changed, but we're waiting for the
+        SIGWINCH signals to stop before rearranging the windows. The last
+        one arrived at resize_time. */
+    static int resize_pending = FALSE;
+    static struct timeval resize_time;
+#endif /* OPT_TIMED_INPUT */
+
+    static int check_size_change(void);
+
+#endif /* OPT_WINCHANGED_SIGNAL */
+#endif /* OPT_USE_SIGNALS */
+
 /* Set up the input system. This is called from main(). */
 void gli_initialize_events()
 {
     halfdelay_running = FALSE;
     timing_msec = 0;
 
+#if defined(OPT_TIMED_INPUT) && defined(OPT_POLL_INPUT)
+    if (pipe(wake_pipe) == 0) {
+        fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    else {
+        wake_pipe[0] = -1;
+        wake_pipe[1] = -1;
+    }
+#endif /* OPT_TIMED_INPUT && OPT_POLL_INPUT */
+
     gli_set_halfdelay();
 }
 
 void glk_select(event_t *event)
 {
     int needrefresh = TRUE;
-    
-    curevent = event;
-    gli_event_clearevent(curevent);
+    int idlework = TRUE; /* Might the windows have background work? */
+    int keyrun = FALSE; /* Was the last thing we did handle a key? */
+    int repaint = FALSE; /* Is the terminal garbage? */
     
     gli_windows_update();
     gli_windows_set_paging(FALSE);
     gli_input_guess_focus();
     
-    while (curevent->type == evtype_None) {
-        int key;
+    while (eventqueue_count == 0) {
+        int key = ERR;
     
-        /* It would be nice to display a "hit any key to continue" message in
-            all windows which require it. */
-        if (needrefresh) {
-            gli_windows_place_cursor();
-            refresh();
-            needrefresh = FALSE;
+        /* If more keys are already waiting (the player is pasting, or
+            typing faster than we can draw), handle them all before
+            bringing the windows and the screen up to date. */
+        if (keyrun)
+            key = (*gli_screen->get_key)(FALSE);
+        
+        if (key == ERR) {
+            keyrun = FALSE;
+            
+            /* It would be nice to display a "hit any key to continue" 
+                message in all windows which require it. */
+            if (needrefresh) {
+                gli_windows_update();
+                gli_windows_place_cursor();
+                (*gli_screen->flush)(repaint);
+                needrefresh = FALSE;
+                repaint = FALSE;
+#ifdef OPT_TIMED_INPUT
+                if (pref_max_refresh)
+                    current_time(&last_refresh);
+#endif /* OPT_TIMED_INPUT */
+            }
+            if (pref_replayfile) {
+                /* Rather than waiting for a key, hand over the next
+                    recorded event. */
+                gli_replay_event(FALSE);
+                continue;
+            }
+            /* Don't wait for a key if there's work to be done. */
+            key = select_key(!idlework);
         }
-        key = getch();
         
 #ifdef OPT_USE_SIGNALS
         if (just_killed) {
@@ -79,6 +172,7 @@ void glk_select(event_t *event)
             /* An actual key has been hit */
             gli_input_handle_key(key);
             needrefresh = TRUE;
+            keyrun = TRUE;
             continue;
         }
 
@@ -87,22 +181,23 @@ void glk_select(event_t *event)
 #ifdef OPT_USE_SIGNALS
 
         /* Check to see if the program has just resumed. This 
-            flag is set by the SIGCONT signal handler. */
+            flag is set by the SIGCONT signal handler. While the program
+            was stopped, the terminal may have been used for anything, so
+            draw it all again. */
         if (just_resumed) {
             just_resumed = FALSE;
             gli_set_halfdelay();
             needrefresh = TRUE;
+            repaint = TRUE;
             continue;
         }
 
 #ifdef OPT_WINCHANGED_SIGNAL
-        /* Check to see if the screen-size has changed. The 
-            screen_size_changed flag is set by the SIGWINCH signal
-            handler. */
-        if (screen_size_changed) {
-            screen_size_changed = FALSE;
-            gli_windows_size_change();
+        /* Check to see if the screen-size has changed (and settled
+            down). */
+        if (check_size_change()) {
             needrefresh = TRUE;
+            idlework = TRUE;
             continue;
         }
 #endif /* OPT_WINCHANGED_SIGNAL */
@@ -111,102 +206,242 @@ void glk_select(event_t *event)
 
 #ifdef OPT_TIMED_INPUT
         /* Check to see if we've passed next_time. */
-        if (timing_msec) {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            if (tv.tv_sec > next_time.tv_sec
-                || (tv.tv_sec == next_time.tv_sec &&
-                    tv.tv_usec > next_time.tv_usec)) {
-                next_time = tv;
-                add_millisec_to_time(&next_time, timing_msec);
-                gli_event_store(evtype_Timer, NULL, 0, 0);
-                continue;
-            }
+        if (timing_msec && timer_due()) {
+            gli_event_store(evtype_Timer, NULL, 0, 0);
+            continue;
         }
 #endif /* OPT_TIMED_INPUT */
 
+        if (idlework) {
+            /* Nothing is happening, so do some background work (laying 
+                out text for a new screen width.) */
+            idlework = gli_windows_idle_work();
+            needrefresh = TRUE;
+        }
     }
     
     /* An event has occurred; glk_select() is over. */
+    gli_event_dequeue(event, TRUE);
+    gli_record_delivered(event, FALSE);
     gli_windows_trim_buffers();
-    curevent = NULL;
 }
 
 void glk_select_poll(event_t *event)
 {
-    int firsttime = TRUE;
+    int redraw = TRUE;
+    int repaint = FALSE;
     
-    curevent = event;
-    gli_event_clearevent(curevent);
+#ifdef OPT_TIMED_INPUT
+    /* A game which polls constantly would spend all its time drawing. So
+        if there's a limit on the refresh rate, only bring the screen up
+        to date once per frame; the rest of the polls just look for 
+        events. */
+    if (pref_max_refresh)
+        redraw = refresh_due();
+#endif /* OPT_TIMED_INPUT */
     
-    gli_windows_update();
+#ifdef OPT_USE_SIGNALS
+    /* If the program has just resumed, the whole terminal has to be
+        drawn again, as in glk_select(). */
+    if (just_resumed) {
+        just_resumed = FALSE;
+        gli_set_halfdelay();
+        redraw = TRUE;
+        repaint = TRUE;
+    }
+#endif /* OPT_USE_SIGNALS */
+    
+    if (redraw) {
+        gli_windows_update();
+        gli_windows_place_cursor();
+        (*gli_screen->flush)(repaint);
+    }
     
     /* Now we check, once, all the stuff that glk_select() checks
         periodically. This includes rearrange events and timer events. 
-       Yes, this looks like a loop, but that's just so we can use
-        continue; it executes exactly once. */
-        
-    while (firsttime) {
-        firsttime = FALSE;
-
-        gli_windows_place_cursor();
-        refresh();
+        Both can happen at once; the event queue holds whichever isn't
+        returned this time. When replaying, the recorded events stand in
+        for all of that. */
+    
+    if (pref_replayfile) {
+        gli_replay_event(TRUE);
+    }
+    else {
         
 #ifdef OPT_USE_SIGNALS
-
-        /* We don't need to check to see if the program has just resumed. 
-            The only reason glk_select() does that is to refresh the screen,
-            and that's just been done anyhow. */
-
 #ifdef OPT_WINCHANGED_SIGNAL
-        /* Check to see if the screen-size has changed. The 
-            screen_size_changed flag is set by the SIGWINCH signal
-            handler. */
-        if (screen_size_changed) {
-            screen_size_changed = FALSE;
-            gli_windows_size_change();
-            continue;
-        }
+        /* Check to see if the screen-size has changed (and settled 
+            down). */
+        check_size_change();
 #endif /* OPT_WINCHANGED_SIGNAL */
-
 #endif /* OPT_USE_SIGNALS */
 
 #ifdef OPT_TIMED_INPUT
         /* Check to see if we've passed next_time. */
-        if (timing_msec) {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            if (tv.tv_sec > next_time.tv_sec
-                || (tv.tv_sec == next_time.tv_sec &&
-                    tv.tv_usec > next_time.tv_usec)) {
-                next_time = tv;
-                add_millisec_to_time(&next_time, timing_msec);
-                gli_event_store(evtype_Timer, NULL, 0, 0);
-                continue;
-            }
-        }
+        if (timing_msec && timer_due())
+            gli_event_store(evtype_Timer, NULL, 0, 0);
 #endif /* OPT_TIMED_INPUT */
     }
 
-    curevent = NULL;
+    /* Input events stay in the queue for glk_select(). */
+    gli_event_dequeue(event, FALSE);
+    gli_record_delivered(event, TRUE);
+}
+
+/* Get a key, if one has been hit. If wait is TRUE, and no key has been
+    hit, wait until one is -- or until it's time to check for timer
+    events, resizing, and so on. Returns ERR if there's no key. */
+static int select_key(int wait)
+{
+#if defined(OPT_TIMED_INPUT) && defined(OPT_POLL_INPUT)
+    int key, fd;
+    struct pollfd fds[2];
+    char buf[16];
+
+    fd = (*gli_screen->input_fd)();
+    if (!wait || fd < 0)
+        return (*gli_screen->get_key)(wait);
+
+    /* The backend may have read ahead of the last key it returned, in
+        which case poll() would not see what's waiting. */
+    key = (*gli_screen->get_key)(FALSE);
+    if (key != ERR)
+        return key;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = wake_pipe[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, ((wake_pipe[0] >= 0) ? 2 : 1), next_wakeup()) <= 0)
+        return ERR; /* time's up, or interrupted by a signal */
+
+    if (fds[1].revents) {
+        while (read(wake_pipe[0], buf, sizeof(buf)) > 0) { }
+    }
+    if (fds[0].revents)
+        return (*gli_screen->get_key)(FALSE);
+    return ERR;
+
+#else /* OPT_TIMED_INPUT && OPT_POLL_INPUT */
+
+    /* The backend's key delay makes this return every so often. */
+    return (*gli_screen->get_key)(wait);
+
+#endif /* OPT_TIMED_INPUT && OPT_POLL_INPUT */
+}
+
+/* Wake up glk_select(), if it's waiting for a key. This is called from
+    signal handlers, so it does nothing but write(). */
+void gli_event_wake()
+{
+#if defined(OPT_TIMED_INPUT) && defined(OPT_POLL_INPUT)
+    if (wake_pipe[1] >= 0) {
+        if (write(wake_pipe[1], "", 1) < 0) {
+            /* The pipe is full, so glk_select() will wake up anyway. */
+        }
+    }
+#endif /* OPT_TIMED_INPUT && OPT_POLL_INPUT */
 }
 
 /* Various modules can call this to indicate that an event has occurred.
-    This doesn't try to queue events, but since a single keystroke or
-    idle event can only cause one event at most, this is fine. */
+    The event is added to the end of the queue. Arrange, Redraw and Timer
+    events say nothing more than that something happened; so if there's
+    one in the queue already, another is not added. If the queue is full
+    (which takes a lot of typing while the game isn't listening), the new
+    event is lost. */
 void gli_event_store(glui32 type, window_t *win, glui32 val1, glui32 val2)
 {
-    if (curevent) {
-        curevent->type = type;
-        curevent->win = win;
-        curevent->val1 = val1;
-        curevent->val2 = val2;
+    int ix;
+    event_t *ev;
+    
+    if (type == evtype_Arrange || type == evtype_Redraw
+        || type == evtype_Timer) {
+        for (ix=0; ix<eventqueue_count; ix++) {
+            ev = &eventqueue[(eventqueue_start+ix) % EVENTQUEUE_SIZE];
+            if (ev->type == type)
+                return;
+        }
     }
+    
+    if (eventqueue_count >= EVENTQUEUE_SIZE)
+        return;
+    
+    ev = &eventqueue[(eventqueue_start+eventqueue_count) % EVENTQUEUE_SIZE];
+    ev->type = type;
+    ev->win = win;
+    ev->val1 = val1;
+    ev->val2 = val2;
+    eventqueue_count++;
+}
+
+/* Take the oldest event out of the queue, and put it in *event. If
+    inputtoo is FALSE, input events are passed over (and left in the
+    queue), as glk_select_poll() must. If there's no suitable event, 
+    *event is cleared to evtype_None. */
+static void gli_event_dequeue(event_t *event, int inputtoo)
+{
+    int ix, jx, pos;
+    event_t *ev;
+    
+    gli_event_clearevent(event);
+    
+    for (ix=0; ix<eventqueue_count; ix++) {
+        pos = (eventqueue_start+ix) % EVENTQUEUE_SIZE;
+        ev = &eventqueue[pos];
+        if (!inputtoo) {
+            if (ev->type == evtype_CharInput || ev->type == evtype_LineInput
+                || ev->type == evtype_MouseInput 
+                || ev->type == evtype_Hyperlink)
+                continue;
+        }
+        break;
+    }
+    if (ix >= eventqueue_count)
+        return;
+    
+    *event = eventqueue[pos];
+    
+    /* Close up the gap, keeping the rest in order. */
+    for (jx=ix; jx>0; jx--) {
+        eventqueue[(eventqueue_start+jx) % EVENTQUEUE_SIZE]
+            = eventqueue[(eventqueue_start+jx-1) % EVENTQUEUE_SIZE];
+    }
+    eventqueue_start = (eventqueue_start+1) % EVENTQUEUE_SIZE;
+    eventqueue_count--;
+}
+
+/* Remove any queued events which refer to this window, because it's being
+    closed. */
+void gli_event_forget_window(window_t *win)
+{
+    int ix, jx;
+    event_t *ev;
+    
+    jx = 0;
+    for (ix=0; ix<eventqueue_count; ix++) {
+        ev = &eventqueue[(eventqueue_start+ix) % EVENTQUEUE_SIZE];
+        if (ev->win == win)
+            continue;
+        if (jx != ix)
+            eventqueue[(eventqueue_start+jx) % EVENTQUEUE_SIZE] = *ev;
+        jx++;
+    }
+    eventqueue_count = jx;
 }
 
 void glk_request_timer_events(glui32 millisecs)
 {
     timing_msec = millisecs;
+#ifdef OPT_TIMED_INPUT
+    if (timing_msec) {
+        /* The first deadline; the rest follow from it. */
+        current_time(&next_time);
+        add_millisec_to_time(&next_time, timing_msec);
+        timer_missed = 0;
+    }
+#endif /* OPT_TIMED_INPUT */
     gli_set_halfdelay();
 }
 
@@ -229,6 +464,11 @@ void glk_request_timer_events(glui32 millisecs)
     has to check for these periodically too. So if OPT_WINCHANGED_SIGNAL
     is defined, we turn on halfdelay() even if the program doesn't want
     timer events. We use a timeout of half a second in this case. 
+   All of this is avoided if OPT_POLL_INPUT is defined (and the screen 
+    backend has a descriptor to poll). Then glk_select() sleeps in poll()
+    until a key arrives, or until the next timer event is due, and
+    signals wake it up. The halfdelay() timeouts are still set, for the
+    benefit of the message line and backends which can't be polled.
 */
     
 void gli_set_halfdelay()
@@ -249,9 +489,6 @@ void gli_set_halfdelay()
         /* turn on */
         halfdelay_running = TRUE;
         
-        gettimeofday(&next_time, NULL);
-        add_millisec_to_time(&next_time, timing_msec);
-        
         if (pref_precise_timing)
             delay = 0;
         else
@@ -266,13 +503,116 @@ void gli_set_halfdelay()
     }
 #endif /* OPT_USE_SIGNALS */
 
-    if (halfdelay_running)
-        halfdelay(delay);
+    if (halfdelay_running) {
+        (*gli_screen->set_key_delay)(delay);
+    }
 
 #endif /* OPT_TIMED_INPUT */
 }
 
+#ifdef OPT_USE_SIGNALS
+#ifdef OPT_WINCHANGED_SIGNAL
+
+/* Check whether the screen size has changed, and if so, rearrange the
+    windows and store an evtype_Arrange event. The screen_size_changed
+    flag is set by the SIGWINCH signal handler.
+   While the player drags the edge of a terminal window, these signals
+    arrive many times a second, and laying out every window for each
+    intermediate size is wasted work. So we wait until no signal has
+    arrived for pref_resize_delay milliseconds, and only then rearrange
+    (once, for the final size). While waiting, key input times out every
+    tenth of a second, so that we notice promptly when things are quiet.
+   Returns TRUE if the windows were rearranged. */
+static int check_size_change()
+{
 #ifdef OPT_TIMED_INPUT
+    struct timeval tv;
+#endif /* OPT_TIMED_INPUT */
+
+    if (screen_size_changed) {
+        screen_size_changed = FALSE;
+#ifdef OPT_TIMED_INPUT
+        if (pref_resize_delay > 0) {
+            current_time(&resize_time);
+            if (!resize_pending) {
+                resize_pending = TRUE;
+                (*gli_screen->set_key_delay)(1);
+            }
+            return FALSE;
+        }
+#endif /* OPT_TIMED_INPUT */
+        gli_windows_size_change();
+        return TRUE;
+    }
+
+#ifdef OPT_TIMED_INPUT
+    if (!resize_pending)
+        return FALSE;
+
+    current_time(&tv);
+    if (millisec_between(&resize_time, &tv) < pref_resize_delay)
+        return FALSE;
+
+    resize_pending = FALSE;
+    gli_set_halfdelay(); /* back to the usual timeout */
+    gli_windows_size_change();
+    return TRUE;
+#else /* OPT_TIMED_INPUT */
+    return FALSE;
+#endif /* OPT_TIMED_INPUT */
+}
+
+#endif /* OPT_WINCHANGED_SIGNAL */
+#endif /* OPT_USE_SIGNALS */
+
+#ifdef OPT_TIMED_INPUT
+
+/* Read the clock. This is the monotonic clock, if the OS has one, so
+    that timers don't jump when the time of day is changed. */
+static void current_time(struct timeval *tv)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif /* CLOCK_MONOTONIC */
+    gettimeofday(tv, NULL);
+}
+
+/* The current_time() clock in milliseconds, for measuring intervals
+    elsewhere in the library. It wraps around every fifty days or so, so
+    subtract two readings as glui32 values. */
+glui32 gli_current_msec()
+{
+    struct timeval tv;
+    
+    current_time(&tv);
+    return (glui32)tv.tv_sec * 1000 + (glui32)(tv.tv_usec / 1000);
+}
+
+/* Return TRUE if tv1 is strictly later than tv2. */
+static int time_after(struct timeval *tv1, struct timeval *tv2)
+{
+    return (tv1->tv_sec > tv2->tv_sec
+        || (tv1->tv_sec == tv2->tv_sec && tv1->tv_usec > tv2->tv_usec));
+}
+
+/* The number of milliseconds from tv1 to tv2 (negative if tv2 is
+    earlier), rounded down. */
+static long millisec_between(struct timeval *tv1, struct timeval *tv2)
+{
+    long usec;
+    
+    usec = (tv2->tv_sec - tv1->tv_sec) * 1000000L 
+        + (tv2->tv_usec - tv1->tv_usec);
+    if (usec < 0)
+        return -((-usec + 999) / 1000);
+    return usec / 1000;
+}
 
 /* Given a time value, add a fixed delay to it. */
 static void add_millisec_to_time(struct timeval *tv, glui32 msec)
@@ -291,5 +631,109 @@ static void add_millisec_to_time(struct timeval *tv, glui32 msec)
     }
 }
 
+#ifdef OPT_POLL_INPUT
+
+/* The number of milliseconds until glk_select() next has to look at the
+    clock, or -1 if it can sleep until something happens. */
+static int next_wakeup()
+{
+    struct timeval tv;
+    long msec, val;
+
+    msec = -1;
+    current_time(&tv);
+
+    if (timing_msec) {
+        /* The timer check wants to be strictly past next_time, so round
+            up. */
+        val = millisec_between(&tv, &next_time) + 1;
+        if (val < 0)
+            val = 0;
+        msec = val;
+    }
+
+#ifdef OPT_USE_SIGNALS
+#ifdef OPT_WINCHANGED_SIGNAL
+    if (resize_pending) {
+        val = pref_resize_delay - millisec_between(&resize_time, &tv) + 1;
+        if (val < 0)
+            val = 0;
+        if (msec < 0 || val < msec)
+            msec = val;
+    }
+#endif /* OPT_WINCHANGED_SIGNAL */
+#endif /* OPT_USE_SIGNALS */
+
+    return (int)msec;
+}
+
+#endif /* OPT_POLL_INPUT */
+
+/* Check whether the next timer event is due. If so, set the deadline for
+    the one after it, and return TRUE.
+   Each deadline is timing_msec after the one before (counting from the
+    glk_request_timer_events() call), no matter how late the last one was
+    noticed; so the timer doesn't drift. If a whole tick or more has been
+    missed (because the game was busy, or the process was stopped), the
+    missed ticks are normally dropped, and the timer carries on from the
+    next deadline still ahead. With -precise, up to MAX_MISSED_TICKS of
+    them are delivered instead, one per glk_select() and without waiting,
+    so that a game which counts ticks stays in step. */
+static int timer_due()
+{
+    struct timeval tv;
+    long behind;
+    
+    current_time(&tv);
+    if (!time_after(&tv, &next_time))
+        return FALSE;
+    
+    add_millisec_to_time(&next_time, timing_msec);
+    if (!time_after(&tv, &next_time)) {
+        timer_missed = 0;
+        return TRUE;
+    }
+    
+    if (pref_precise_timing && timer_missed < MAX_MISSED_TICKS) {
+        /* next_time is still in the past, so the next check fires too. */
+        timer_missed++;
+        return TRUE;
+    }
+    
+    behind = millisec_between(&next_time, &tv);
+    if (behind < 1000000000L && timing_msec < 1000000000L) {
+        add_millisec_to_time(&next_time, 
+            (glui32)(behind / (long)timing_msec + 1) * timing_msec);
+    }
+    else {
+        /* Ages behind; just start again from now. */
+        next_time = tv;
+        add_millisec_to_time(&next_time, timing_msec);
+    }
+    timer_missed = 0;
+    return TRUE;
+}
+
+/* Check whether a frame's worth of time has passed since the screen was
+    last refreshed. If so, start a new frame and return TRUE. */
+static int refresh_due()
+{
+    struct timeval tv;
+    long usec;
+    
+    current_time(&tv);
+    if (tv.tv_sec - last_refresh.tv_sec > 1) {
+        /* Long enough. */
+        last_refresh = tv;
+        return TRUE;
+    }
+    usec = (tv.tv_sec - last_refresh.tv_sec) * 1000000L
+        + (tv.tv_usec - last_refresh.tv_usec);
+    if (usec < 1000000L / pref_max_refresh)
+        return FALSE;
+    last_refresh = tv;
+    return TRUE;
+}
+
 #endif /* OPT_TIMED_INPUT */
 
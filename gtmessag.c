@@ -11,6 +11,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 
 /* Nothing fancy here. We store a string, and print it on the bottom line.
     If pref_messageline is FALSE, none of these functions do anything. */
@@ -66,24 +67,21 @@ void gli_msgline_redraw()
         return;
         
     if (msgbuflen == 0) {
-        move(content_box.bottom, 0);
-        clrtoeol();
+        (*gli_screen->set_pos)(content_box.bottom, 0);
+        (*gli_screen->clear_eol)();
     }
     else {
-        int ix, len;
+        int len;
         
-        move(content_box.bottom, 0);
-        addch(' ');
-        addch(' ');
-        attron(A_REVERSE);
+        (*gli_screen->set_pos)(content_box.bottom, 0);
+        (*gli_screen->put_string)("  ", 2);
+        (*gli_screen->set_attr)(A_REVERSE);
         if (msgbuflen > content_box.right-3)
             len = content_box.right-3;
         else
             len = msgbuflen;
-        for (ix=0; ix<len; ix++) {
-            addch(msgbuf[ix]);
-        }
-        attrset(0);
-        clrtoeol();
+        (*gli_screen->put_string)(msgbuf, len);
+        (*gli_screen->set_attr)(0);
+        (*gli_screen->clear_eol)();
     }
 }
@@ -11,6 +11,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 
 /* This is for when the library wants to prompt for some input, but not
     in a window. It is currently used in two places: 
@@ -61,31 +62,31 @@ int gli_msgin_getchar(char *prompt, int hilite)
     }
     else {
         orgy = content_box.bottom-1;
-        move(orgy, 0);
-        clrtoeol();
+        (*gli_screen->set_pos)(orgy, 0);
+        (*gli_screen->clear_eol)();
     }
 
-    move(orgy, LEFT_MARGIN);
+    (*gli_screen->set_pos)(orgy, LEFT_MARGIN);
     if (hilite)
-        attron(A_REVERSE);
-    addstr(prompt);
+        (*gli_screen->set_attr)(A_REVERSE);
+    (*gli_screen->put_string)(prompt, strlen(prompt));
     if (hilite)
-        attrset(0);
+        (*gli_screen->set_attr)(0);
 
-    move(orgy, orgx);
-    refresh();
+    (*gli_screen->set_pos)(orgy, orgx);
+    (*gli_screen->flush)(FALSE);
 
     key = ERR;
     while (key == ERR) {
-        key = getch();
+        key = (*gli_screen->get_key)(TRUE);
     }
     
     if (pref_messageline) {
         gli_msgline(NULL);
     }
     else {
-        move(orgy, 0);
-        clrtoeol();
+        (*gli_screen->set_pos)(orgy, 0);
+        (*gli_screen->clear_eol)();
         /* We have to redraw everything, unfortunately, to fix the
             last line. */
         gli_windows_update();
@@ -124,12 +125,12 @@ int gli_msgin_getline(char *prompt, char *buf, int maxlen, int *length)
     }
     else {
         lin->orgy = content_box.bottom-1;
-        move(lin->orgy, 0);
-        clrtoeol();
+        (*gli_screen->set_pos)(lin->orgy, 0);
+        (*gli_screen->clear_eol)();
     }
     
-    move(lin->orgy, LEFT_MARGIN);
-    addstr(lin->prompt);
+    (*gli_screen->set_pos)(lin->orgy, LEFT_MARGIN);
+    (*gli_screen->put_string)(lin->prompt, strlen(lin->prompt));
     update_text(lin);
     
     needrefresh = TRUE;
@@ -137,13 +138,13 @@ int gli_msgin_getline(char *prompt, char *buf, int maxlen, int *length)
     while (!lin->done) {
         int key;
         
-        move(lin->orgy, lin->orgx + lin->curs);
+        (*gli_screen->set_pos)(lin->orgy, lin->orgx + lin->curs);
         if (needrefresh) {
-            refresh();
+            (*gli_screen->flush)(FALSE);
             needrefresh = FALSE;
         }
 
-        key = getch();
+        key = (*gli_screen->get_key)(TRUE);
         
         if (key != ERR) {
             handle_key(lin, key);
@@ -156,8 +157,8 @@ int gli_msgin_getline(char *prompt, char *buf, int maxlen, int *length)
         gli_msgline(NULL);
     }
     else {
-        move(lin->orgy, 0);
-        clrtoeol();
+        (*gli_screen->set_pos)(lin->orgy, 0);
+        (*gli_screen->clear_eol)();
         /* We have to redraw everything, unfortunately, to fix the
             last line. */
         gli_windows_update();
@@ -169,13 +170,9 @@ int gli_msgin_getline(char *prompt, char *buf, int maxlen, int *length)
 
 static void update_text(inline_t *lin)
 {
-    int ix;
-    
-    move(lin->orgy, lin->orgx);
-    for (ix=0; ix<lin->len; ix++) {
-        addch(lin->buf[ix]);
-    }
-    clrtoeol();
+    (*gli_screen->set_pos)(lin->orgy, lin->orgx);
+    (*gli_screen->put_string)(lin->buf, lin->len);
+    (*gli_screen->clear_eol)();
 }
 
 static void handle_key(inline_t *lin, int key)
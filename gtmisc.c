@@ -11,6 +11,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 
 static unsigned char char_tolower_table[256];
 static unsigned char char_toupper_table[256];
@@ -146,7 +147,7 @@ void glk_exit()
 
     gli_streams_close_all();
 
-    endwin();
+    (*gli_screen->shutdown)();
     putchar('\n');
     exit(0);
 }
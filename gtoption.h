@@ -79,6 +79,48 @@
     is also defined.
 */
 
+#define OPT_SCROLLBACK_SPILL
+
+/* OPT_SCROLLBACK_SPILL should be defined if your OS supports the
+    mmap() and ftruncate() calls. If this is defined, text which is
+    trimmed off the top of a buffer window (see the -scrollback option)
+    is saved in a temporary file, and is read back in when the player
+    scrolls up past the text in memory. (The -spill option turns this
+    off at run time.) If this is not defined, trimmed text is simply
+    discarded.
+*/
+
+#define OPT_LAYOUT_THREADS
+
+/* OPT_LAYOUT_THREADS should be defined if your OS supports POSIX threads
+    (pthread.h). If this is defined, the -threads option lets GlkTerm use
+    several threads to lay out a large amount of buffer window text (after
+    the screen is resized, for example.) You will have to link with the
+    pthread library; see LIBS in the Makefile. If this is not defined, all
+    layout is done in the main thread.
+*/
+
+#define OPT_DIRECT_SCREEN
+
+/* OPT_DIRECT_SCREEN should be defined if your OS supports the POSIX
+    termios.h and select() calls. If this is defined, the -direct option
+    lets GlkTerm draw on an ANSI (VT100-style) terminal by itself, 
+    rather than through curses. This sends less to the terminal, which
+    helps over a slow connection. If this is not defined, GlkTerm always
+    uses curses.
+*/
+
+#define OPT_POLL_INPUT
+
+/* OPT_POLL_INPUT should be defined if your OS supports the poll() and
+    pipe() calls. If this is defined, glk_select() sleeps in poll() until
+    a key is hit, a timer event is due, or a signal arrives, instead of
+    waking up every half second (or tenth of a second, when timer events
+    are running) to check for these. This saves CPU time when the game
+    is idle. OPT_POLL_INPUT will be ignored unless OPT_TIMED_INPUT is 
+    also defined.
+*/
+
 /* #define NO_MEMMOVE */
 
 /* NO_MEMMOVE should be defined if your standard library doesn't
@@ -0,0 +1,541 @@
+/* gtrecord.c: Recording and replaying input sessions
+        for GlkTerm, curses.h implementation of the Glk API.
+    Designed by Andrew Plotkin <erkyrath@eblong.com>
+    http://www.eblong.com/zarf/glk/index.html
+*/
+
+#include "gtoption.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curses.h>
+#include "glk.h"
+#include "glkterm.h"
+#include "gtscreen.h"
+#include "gtw_buf.h"
+#include "gtw_grid.h"
+
+/* With -record, every event that glk_select() or glk_select_poll()
+    returns is written to a file. With -replay, the events are read back
+    and handed to the game in the same order, as fast as it will take
+    them, with the headless screen. A game which does the same thing
+    given the same input will then go through the whole session again;
+    so a recorded session is a benchmark, and (with the final screen
+    which -headless prints) a regression test.
+   The file is binary. It starts with the four bytes "GLKR", a format
+    version byte, and the screen width and height. Then there is one
+    record per event:
+        a byte: the event type, plus 0x80 if glk_select_poll() returned it
+        the number of polls that returned nothing since the last record
+        the milliseconds since the last record
+        the window: 0 for none, or 1 plus its position in tree order
+        val1
+        val2
+        for evtype_LineInput, val1 characters (Latin-1 or Unicode values)
+    Every number after the type byte is unsigned, written seven bits to a
+    byte, low bits first, with the top bit set on all but the last byte.
+    So most records take only seven or eight bytes.
+   Only events go into the file. The text the player types before the
+    game cancels line input, file names typed at the message line, and
+    changes of the screen size are not recorded; a replayed evtype_Arrange
+    event rearranges nothing. */
+
+#define RECORD_MAGIC "GLKR"
+#define RECORD_VERSION (1)
+
+#define POLLED_FLAG (0x80)
+
+typedef struct record_struct {
+    glui32 type;
+    int polled;
+    glui32 polls;
+    glui32 msec;
+    glui32 winnum; /* 0 for no window */
+    glui32 val1, val2;
+} record_t;
+
+/* The text of a line input, saved when the line is accepted, until the
+    event is returned. (By then the game's buffer may have been
+    unregistered, and not be there to look at.) There is at most one per
+    window. */
+typedef struct savedline_struct {
+    window_t *win;
+    glui32 *buf;
+    glui32 len;
+} savedline_t;
+
+static FILE *recfile = NULL;
+static int replaying = FALSE;
+
+static savedline_t *savedlines = NULL;
+static int numsavedlines = 0;
+static int savedlinessize = 0;
+
+static glui32 emptypolls = 0; /* polls since the last record */
+static long numrecords = 0;
+
+static record_t expected; /* the next record to replay */
+static int loaded = FALSE; /* expected has been read from the file */
+static int expecting = FALSE; /* it has been replayed, but glk_select()
+    hasn't returned it yet */
+static int atend = FALSE; /* the file has run out */
+static long recordedmsec = 0; /* the length of the recorded session */
+
+#ifdef OPT_TIMED_INPUT
+/* Times from gli_current_msec(). */
+static glui32 last_time;
+static glui32 start_time;
+#endif /* OPT_TIMED_INPUT */
+
+static glui32 elapsed_msec(void);
+static void put_number(glui32 val);
+static int get_number(glui32 *val);
+static int read_record(record_t *rec);
+static glui32 window_number(window_t *win);
+static window_t *numbered_window(glui32 winnum);
+static int native_key(glui32 ch);
+static void replay_line(window_t *win, glui32 termkey);
+static void replay_finish(void);
+static void replay_report(void);
+static void replay_fail(char *msg);
+
+/* Open the -record or -replay file. This is called from main(), before
+    the screen is set up; so for a replay, it can choose the headless
+    screen, at the recorded size. Returns FALSE (having printed a message)
+    if the file can't be used. */
+int gli_initialize_record(char *progname)
+{
+    char buf[5];
+    glui32 width, height;
+
+#ifdef OPT_TIMED_INPUT
+    start_time = gli_current_msec();
+    last_time = start_time;
+#endif /* OPT_TIMED_INPUT */
+
+    if (pref_recordfile) {
+        recfile = fopen(pref_recordfile, "wb");
+        if (!recfile) {
+            printf("%s: unable to create record file: %s\n",
+                progname, pref_recordfile);
+            return FALSE;
+        }
+        /* The header is written once the screen size is known. */
+        return TRUE;
+    }
+
+    if (pref_replayfile) {
+        recfile = fopen(pref_replayfile, "rb");
+        if (!recfile) {
+            printf("%s: unable to open replay file: %s\n",
+                progname, pref_replayfile);
+            return FALSE;
+        }
+        if (fread(buf, 1, 5, recfile) != 5
+            || memcmp(buf, RECORD_MAGIC, 4)
+            || buf[4] != RECORD_VERSION
+            || !get_number(&width) || !get_number(&height)) {
+            printf("%s: not a GlkTerm record file: %s\n",
+                progname, pref_replayfile);
+            fclose(recfile);
+            recfile = NULL;
+            return FALSE;
+        }
+        replaying = TRUE;
+        atexit(&replay_report);
+        pref_headless = TRUE;
+        if (!pref_screenwidth)
+            pref_screenwidth = width;
+        if (!pref_screenheight)
+            pref_screenheight = height;
+        return TRUE;
+    }
+
+    return TRUE;
+}
+
+/* Save the text of a line input which has just been accepted, so that it
+    can be recorded when the event is returned. */
+void gli_record_line(window_t *win, void *buf, int unicode, glui32 len)
+{
+    int ix;
+    glui32 jx;
+    savedline_t *sl;
+
+    if (!recfile || replaying)
+        return;
+
+    for (ix=0; ix<numsavedlines; ix++) {
+        if (savedlines[ix].win == win)
+            break;
+    }
+    if (ix >= numsavedlines) {
+        if (numsavedlines >= savedlinessize) {
+            savedlinessize = (savedlinessize ? savedlinessize*2 : 4);
+            savedlines = (savedline_t *)realloc(savedlines,
+                savedlinessize * sizeof(savedline_t));
+        }
+        savedlines[ix].win = win;
+        savedlines[ix].buf = NULL;
+        numsavedlines++;
+    }
+    sl = &savedlines[ix];
+
+    sl->buf = (glui32 *)realloc(sl->buf, (len+1) * sizeof(glui32));
+    sl->len = len;
+    for (jx=0; jx<len; jx++) {
+        if (!unicode)
+            sl->buf[jx] = ((unsigned char *)buf)[jx];
+        else
+            sl->buf[jx] = ((glui32 *)buf)[jx];
+    }
+}
+
+/* This is called with every event that glk_select() or glk_select_poll()
+    returns (including the evtype_None of a poll where nothing happened).
+    When recording, the event is written to the file. When replaying, it
+    is checked against the event which was replayed; if the game has
+    gone a different way from the recorded session, the replay stops. */
+void gli_record_delivered(event_t *event, int polled)
+{
+    int ix;
+    glui32 jx;
+    savedline_t *sl;
+    record_t rec;
+
+    if (!recfile)
+        return;
+
+    if (replaying) {
+        if (event->type == evtype_None)
+            return;
+        if (!expecting || event->type != expected.type
+            || window_number(event->win) != expected.winnum
+            || event->val1 != expected.val1 || event->val2 != expected.val2)
+            replay_fail("the game got an event which was not recorded");
+        expecting = FALSE;
+        return;
+    }
+
+    if (event->type == evtype_None) {
+        emptypolls++;
+        return;
+    }
+
+    if (numrecords == 0) {
+        int width, height;
+        (*gli_screen->get_size)(&width, &height);
+        if (pref_screenwidth)
+            width = pref_screenwidth;
+        if (pref_screenheight)
+            height = pref_screenheight;
+        fwrite(RECORD_MAGIC, 1, 4, recfile);
+        putc(RECORD_VERSION, recfile);
+        put_number(width);
+        put_number(height);
+    }
+
+    rec.type = event->type;
+    rec.polled = polled;
+    rec.polls = emptypolls;
+    rec.msec = elapsed_msec();
+    rec.winnum = window_number(event->win);
+    rec.val1 = event->val1;
+    rec.val2 = event->val2;
+
+    putc((rec.type & 0x7F) | (rec.polled ? POLLED_FLAG : 0), recfile);
+    put_number(rec.polls);
+    put_number(rec.msec);
+    put_number(rec.winnum);
+    put_number(rec.val1);
+    put_number(rec.val2);
+
+    if (rec.type == evtype_LineInput) {
+        sl = NULL;
+        for (ix=0; ix<numsavedlines; ix++) {
+            if (savedlines[ix].win == event->win) {
+                sl = &savedlines[ix];
+                break;
+            }
+        }
+        for (jx=0; jx<rec.val1; jx++)
+            put_number((sl && jx < sl->len) ? sl->buf[jx] : ' ');
+    }
+
+    /* A session may end at any moment (with a ctrl-C), so keep the file
+        up to date. This is once per event, which is not often. */
+    fflush(recfile);
+
+    emptypolls = 0;
+    numrecords++;
+}
+
+/* Replay the next recorded event, by storing it (or, for line input,
+    typing it) so that glk_select() will return it. If polled is TRUE,
+    this is for glk_select_poll(), and nothing is done unless the next
+    event was returned by a poll -- after as many empty polls as were
+    recorded. If the file has run out, the replay is over, and this exits.
+   Returns TRUE if an event was stored. */
+int gli_replay_event(int polled)
+{
+    window_t *win;
+
+    if (!replaying)
+        return FALSE;
+
+    if (expecting) {
+        /* glk_select() only asks for an event when its queue is empty;
+            so if the last one is still expected, it was never queued. */
+        if (!polled)
+            replay_fail("a replayed event was lost");
+        return FALSE;
+    }
+
+    if (!loaded) {
+        if (!read_record(&expected))
+            replay_finish();
+        loaded = TRUE;
+        emptypolls = 0;
+    }
+
+    if (!polled && expected.polled) {
+        /* The game is waiting in glk_select() for an event which, when
+            the session was recorded, it got from glk_select_poll(). */
+        replay_fail("glk_select() was called instead of glk_select_poll()");
+    }
+
+    if (polled) {
+        if (!expected.polled || emptypolls < expected.polls) {
+            emptypolls++;
+            return FALSE;
+        }
+    }
+
+    loaded = FALSE;
+    expecting = TRUE;
+
+    win = NULL;
+    if (expected.winnum) {
+        win = numbered_window(expected.winnum);
+        if (!win)
+            replay_fail("the window for an event does not exist");
+    }
+
+    switch (expected.type) {
+        case evtype_CharInput:
+            if (!win)
+                replay_fail("character input has no window");
+            if (!win->char_request)
+                replay_fail("character input was not requested");
+            win->char_request = FALSE;
+            gli_event_store(evtype_CharInput, win, expected.val1, 0);
+            break;
+        case evtype_LineInput:
+            if (!win)
+                replay_fail("line input has no window");
+            if (!win->line_request)
+                replay_fail("line input was not requested");
+            replay_line(win, expected.val2);
+            break;
+        default:
+            gli_event_store(expected.type, win,
+                expected.val1, expected.val2);
+            break;
+    }
+
+    return TRUE;
+}
+
+/* Type in the recorded text of a line input, replacing whatever was in
+    the input line, and accept it. */
+static void replay_line(window_t *win, glui32 termkey)
+{
+    glui32 ix, ch;
+    int key;
+
+    if (win->type == wintype_TextBuffer)
+        gcmd_buffer_delete(win, gcmd_KillInput);
+    else if (win->type == wintype_TextGrid)
+        gcmd_grid_delete(win, gcmd_KillInput);
+
+    for (ix=0; ix<expected.val1; ix++) {
+        if (!get_number(&ch))
+            replay_fail("the record file is cut short");
+        key = native_key(ch);
+        if (win->type == wintype_TextBuffer)
+            gcmd_buffer_insert_key(win, key);
+        else if (win->type == wintype_TextGrid)
+            gcmd_grid_insert_key(win, key);
+    }
+
+    /* The terminator key is passed on as it would come from curses. */
+    key = 0;
+    if (termkey == keycode_Escape) {
+        key = '\033';
+    }
+#ifdef KEY_F
+    else if (termkey <= keycode_Func1 && termkey >= keycode_Func12) {
+        key = KEY_F(keycode_Func1 - termkey + 1);
+    }
+#endif /* KEY_F */
+
+    if (win->type == wintype_TextBuffer)
+        gcmd_buffer_accept_line(win, key);
+    else if (win->type == wintype_TextGrid)
+        gcmd_grid_accept_line(win, key);
+}
+
+/* Convert a Latin-1 character back to the key which would be typed for
+    it. */
+static int native_key(glui32 ch)
+{
+    if (ch > 0xFF)
+        return '?';
+#ifdef OPT_NATIVE_LATIN_1
+    return ch;
+#else /* OPT_NATIVE_LATIN_1 */
+    if (!char_to_native_table[ch])
+        return '?';
+    return char_to_native_table[ch];
+#endif /* OPT_NATIVE_LATIN_1 */
+}
+
+/* The replay is over; end the game. */
+static void replay_finish()
+{
+    fclose(recfile);
+    recfile = NULL;
+    gli_fast_exit();
+}
+
+/* Say how long the replay took. This is called when the program exits,
+    whether the game ended or the record file ran out. */
+static void replay_report()
+{
+#ifdef OPT_TIMED_INPUT
+    glui32 msec = gli_current_msec() - start_time;
+
+    fprintf(stderr, "Replayed %ld events (%ld ms recorded) in %ld ms.\n",
+        numrecords, recordedmsec, (long)msec);
+#else /* OPT_TIMED_INPUT */
+    fprintf(stderr, "Replayed %ld events.\n", numrecords);
+#endif /* OPT_TIMED_INPUT */
+}
+
+/* The game has not done what it did when the session was recorded, or
+    the record file is damaged. Say so, and end the game -- as 
+    gli_fast_exit() does, but with a failing exit status, so that a 
+    script running the replay can tell. */
+static void replay_fail(char *msg)
+{
+    fprintf(stderr, "Replay stopped at event %ld: %s.\n",
+        numrecords, msg);
+    fclose(recfile);
+    recfile = NULL;
+
+    if (gli_interrupt_handler) {
+        (*gli_interrupt_handler)();
+    }
+
+    gli_streams_close_all();
+    (*gli_screen->shutdown)();
+    putchar('\n');
+    exit(1);
+}
+
+static int read_record(record_t *rec)
+{
+    int ch;
+
+    if (atend)
+        return FALSE;
+
+    ch = getc(recfile);
+    if (ch == EOF) {
+        atend = TRUE;
+        return FALSE;
+    }
+    rec->type = (ch & 0x7F);
+    rec->polled = ((ch & POLLED_FLAG) != 0);
+    if (!get_number(&rec->polls) || !get_number(&rec->msec)
+        || !get_number(&rec->winnum)
+        || !get_number(&rec->val1) || !get_number(&rec->val2))
+        replay_fail("the record file is cut short");
+
+    recordedmsec += rec->msec;
+    numrecords++;
+    return TRUE;
+}
+
+/* The milliseconds since this was last called. */
+static glui32 elapsed_msec()
+{
+#ifdef OPT_TIMED_INPUT
+    glui32 now = gli_current_msec();
+    glui32 msec = now - last_time;
+
+    last_time = now;
+    return msec;
+#else /* OPT_TIMED_INPUT */
+    return 0;
+#endif /* OPT_TIMED_INPUT */
+}
+
+static void put_number(glui32 val)
+{
+    while (val >= 0x80) {
+        putc((int)((val & 0x7F) | 0x80), recfile);
+        val >>= 7;
+    }
+    putc((int)val, recfile);
+}
+
+static int get_number(glui32 *val)
+{
+    int ch, shift;
+
+    *val = 0;
+    for (shift = 0; shift < 35; shift += 7) {
+        ch = getc(recfile);
+        if (ch == EOF)
+            return FALSE;
+        *val |= ((glui32)(ch & 0x7F)) << shift;
+        if (!(ch & 0x80))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static glui32 window_number(window_t *win)
+{
+    window_t *win2;
+    glui32 winnum;
+
+    if (!win)
+        return 0;
+
+    winnum = 1;
+    for (win2 = gli_window_iterate_treeorder(NULL);
+        win2;
+        win2 = gli_window_iterate_treeorder(win2)) {
+        if (win2 == win)
+            return winnum;
+        winnum++;
+    }
+    return 0;
+}
+
+static window_t *numbered_window(glui32 winnum)
+{
+    window_t *win;
+
+    for (win = gli_window_iterate_treeorder(NULL);
+        win;
+        win = gli_window_iterate_treeorder(win)) {
+        winnum--;
+        if (winnum == 0)
+            return win;
+    }
+    return NULL;
+}
@@ -0,0 +1,984 @@
+/* gtscreen.c: Screen backends
+        for GlkTerm, curses.h implementation of the Glk API.
+    Designed by Andrew Plotkin <erkyrath@eblong.com>
+    http://www.eblong.com/zarf/glk/index.html
+*/
+
+#include "gtoption.h"
+#ifdef OPT_DIRECT_SCREEN
+#define _POSIX_C_SOURCE (200112L) /* for termios, select(), and 
+    sigprocmask() */
+#endif /* OPT_DIRECT_SCREEN */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curses.h>
+#ifdef OPT_DIRECT_SCREEN
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#ifdef OPT_USE_SIGNALS
+#include <signal.h>
+#endif /* OPT_USE_SIGNALS */
+#endif /* OPT_DIRECT_SCREEN */
+#include "glk.h"
+#include "glkterm.h"
+#include "gtscreen.h"
+
+/* The backend in use. main() may switch this to another backend before
+    setting it up. */
+screen_t *gli_screen = &gli_screen_curses;
+
+/* ---- The virtual screen. ---- */
+
+/* Every backend draws into a virtual screen: an array of cells, row by
+    row. Each cell is a character ORed with its attributes, as curses 
+    stores them. Drawing outside the screen is ignored.
+   Each row also keeps its damage: the range of cells which have changed
+    since the screen was last flushed. Drawing a cell with what it 
+    already holds is not a change. So when a turn's updates cover the
+    same cells more than once -- a window drawn twice, a border drawn 
+    over, the message line -- the flush still only sends the cells that
+    really differ, once each. */
+static chtype *cells = NULL;
+static int cells_width, cells_height;
+static int cells_xpos, cells_ypos;
+static chtype cells_attr;
+static int *cells_dirtybeg = NULL; /* -1 if the row is undamaged. */
+static int *cells_dirtyend = NULL;
+
+#define cell_at(arr, ypos, xpos)   \
+    ((arr)[(long)(ypos) * cells_width + (xpos)])
+
+/* Allocate an array of blank cells, the size of the screen. */
+static chtype *cells_alloc()
+{
+    long ix, count;
+    chtype *arr;
+
+    count = (long)cells_width * cells_height;
+    arr = (chtype *)malloc((count ? count : 1) * sizeof(chtype));
+    if (!arr) {
+        printf("Unable to allocate the screen.\n");
+        exit(1);
+    }
+    for (ix=0; ix<count; ix++)
+        arr[ix] = ' ';
+    return arr;
+}
+
+/* Set up a blank, undamaged screen of the given size. (The terminal is
+    assumed to be blank too.) */
+static void cells_setup(int width, int height)
+{
+    int jx;
+
+    if (cells) {
+        free(cells);
+        free(cells_dirtybeg);
+        free(cells_dirtyend);
+    }
+    cells_width = width;
+    cells_height = height;
+    cells = cells_alloc();
+    cells_dirtybeg = (int *)malloc((height ? height : 1) * sizeof(int));
+    cells_dirtyend = (int *)malloc((height ? height : 1) * sizeof(int));
+    if (!cells_dirtybeg || !cells_dirtyend) {
+        printf("Unable to allocate the screen.\n");
+        exit(1);
+    }
+    for (jx=0; jx<height; jx++) {
+        cells_dirtybeg[jx] = -1;
+        cells_dirtyend[jx] = -1;
+    }
+
+    cells_xpos = 0;
+    cells_ypos = 0;
+    cells_attr = 0;
+}
+
+static void cells_free()
+{
+    if (!cells)
+        return;
+    free(cells);
+    free(cells_dirtybeg);
+    free(cells_dirtyend);
+    cells = NULL;
+    cells_dirtybeg = NULL;
+    cells_dirtyend = NULL;
+}
+
+/* Add cells beg to end (exclusive) of row ypos to the damage. */
+static void cells_damage(int ypos, int beg, int end)
+{
+    if (cells_dirtybeg[ypos] == -1 || beg < cells_dirtybeg[ypos])
+        cells_dirtybeg[ypos] = beg;
+    if (cells_dirtyend[ypos] == -1 || end > cells_dirtyend[ypos])
+        cells_dirtyend[ypos] = end;
+}
+
+/* Damage the whole screen, so that the next flush looks at everything. */
+static void cells_damage_all()
+{
+    int jx;
+
+    for (jx=0; jx<cells_height; jx++)
+        cells_damage(jx, 0, cells_width);
+}
+
+/* Forget the damage; the flush has dealt with it. */
+static void cells_undamage()
+{
+    int jx;
+
+    for (jx=0; jx<cells_height; jx++) {
+        cells_dirtybeg[jx] = -1;
+        cells_dirtyend[jx] = -1;
+    }
+}
+
+static void cells_get_size(int *width, int *height)
+{
+    *width = cells_width;
+    *height = cells_height;
+}
+
+static void cells_set_pos(int ypos, int xpos)
+{
+    cells_xpos = xpos;
+    cells_ypos = ypos;
+}
+
+static void cells_set_attr(chtype attr)
+{
+    cells_attr = attr;
+}
+
+/* Store ch in row ypos, from xpos on, for len cells; and damage the ones
+    that change. */
+static void cells_fill(int ypos, int xpos, chtype ch, int len)
+{
+    int ix, end, beg = -1, last = 0;
+    chtype *cx;
+
+    if (ypos < 0 || ypos >= cells_height)
+        return;
+    end = xpos + len;
+    if (end > cells_width)
+        end = cells_width;
+    if (xpos < 0)
+        xpos = 0;
+    cx = &cell_at(cells, ypos, xpos);
+    for (ix=xpos; ix<end; ix++, cx++) {
+        if (*cx != ch) {
+            *cx = ch;
+            if (beg < 0)
+                beg = ix;
+            last = ix+1;
+        }
+    }
+    if (beg >= 0)
+        cells_damage(ypos, beg, last);
+}
+
+static void cells_put_char(int ch)
+{
+    cells_fill(cells_ypos, cells_xpos, (unsigned char)ch | cells_attr, 1);
+    cells_xpos++;
+}
+
+static void cells_put_string(char *str, int len)
+{
+    int ix, beg = -1, end = 0;
+    chtype ch, *cx;
+
+    if (cells_ypos < 0 || cells_ypos >= cells_height) {
+        cells_xpos += len;
+        return;
+    }
+    for (ix=0; ix<len && str[ix]; ix++, cells_xpos++) {
+        if (cells_xpos < 0 || cells_xpos >= cells_width)
+            continue;
+        ch = (unsigned char)str[ix] | cells_attr;
+        cx = &cell_at(cells, cells_ypos, cells_xpos);
+        if (*cx != ch) {
+            *cx = ch;
+            if (beg < 0)
+                beg = cells_xpos;
+            end = cells_xpos+1;
+        }
+    }
+    if (beg >= 0)
+        cells_damage(cells_ypos, beg, end);
+}
+
+static void cells_put_spaces(int len)
+{
+    cells_fill(cells_ypos, cells_xpos, ' ', len);
+}
+
+static void cells_clear_eol()
+{
+    cells_fill(cells_ypos, cells_xpos, ' ', cells_width - cells_xpos);
+}
+
+static void cells_clear_all()
+{
+    int jx;
+
+    for (jx=0; jx<cells_height; jx++)
+        cells_fill(jx, 0, ' ', cells_width);
+    cells_xpos = 0;
+    cells_ypos = 0;
+}
+
+/* Scroll lines top through bottom of arr, which is either the screen's
+    cells or a copy of them. */
+static void scroll_cells(chtype *arr, int top, int bottom, int delta)
+{
+    int jx, ix, src;
+
+    if (delta > 0) {
+        for (jx=top; jx<=bottom; jx++) {
+            src = jx + delta;
+            for (ix=0; ix<cells_width; ix++)
+                cell_at(arr, jx, ix) =
+                    (src <= bottom) ? cell_at(arr, src, ix) : ' ';
+        }
+    }
+    else if (delta < 0) {
+        for (jx=bottom; jx>=top; jx--) {
+            src = jx + delta;
+            for (ix=0; ix<cells_width; ix++)
+                cell_at(arr, jx, ix) =
+                    (src >= top) ? cell_at(arr, src, ix) : ' ';
+        }
+    }
+}
+
+/* Scroll the virtual screen. This goes along with scrolling the 
+    terminal, so the damage moves with the lines, and the lines that
+    come in blank are undamaged. */
+static void cells_scroll(int top, int bottom, int delta)
+{
+    int jx, src;
+
+    if (top < 0)
+        top = 0;
+    if (bottom >= cells_height)
+        bottom = cells_height-1;
+    scroll_cells(cells, top, bottom, delta);
+
+    if (delta > 0) {
+        for (jx=top; jx<=bottom; jx++) {
+            src = jx + delta;
+            cells_dirtybeg[jx] = (src <= bottom) ? cells_dirtybeg[src] : -1;
+            cells_dirtyend[jx] = (src <= bottom) ? cells_dirtyend[src] : -1;
+        }
+    }
+    else if (delta < 0) {
+        for (jx=bottom; jx>=top; jx--) {
+            src = jx + delta;
+            cells_dirtybeg[jx] = (src >= top) ? cells_dirtybeg[src] : -1;
+            cells_dirtyend[jx] = (src >= top) ? cells_dirtyend[src] : -1;
+        }
+    }
+}
+
+/* Return the virtual screen, for a test harness to examine. This 
+    returns NULL if the screen has not been set up. */
+chtype *gli_headless_cells(int *width, int *height)
+{
+    if (width)
+        *width = cells_width;
+    if (height)
+        *height = cells_height;
+    return cells;
+}
+
+/* ---- The curses backend. ---- */
+
+/* Curses keeps its own copy of the screen, of course. At each flush,
+    the damaged part of each row is handed to it in one call. */
+
+static int curses_keydelay = -1; /* How long a waiting getch() waits, in
+    milliseconds, or -1 to wait for a key however long it takes. */
+static volatile int curses_restarted = FALSE; /* Set when curses has been
+    started again, with a blank screen. */
+
+static void curses_init()
+{
+    initscr();
+    cbreak();
+    noecho();
+    nonl();
+    intrflush(stdscr, FALSE);
+    keypad(stdscr, TRUE);
+    scrollok(stdscr, FALSE);
+    idlok(stdscr, TRUE);
+}
+
+static void curses_setup()
+{
+    curses_init();
+    cells_setup(COLS, LINES);
+}
+
+static void curses_reset()
+{
+    endwin();
+
+    newterm(getenv("TERM"), stdout, stdin);
+    curses_init();
+    curses_restarted = TRUE;
+}
+
+static void curses_shutdown()
+{
+    endwin();
+    cells_free();
+}
+
+static void curses_get_size(int *width, int *height)
+{
+    if (COLS != cells_width || LINES != cells_height) {
+        /* Everything will be redrawn for the new size. */
+        cells_setup(COLS, LINES);
+        clear();
+    }
+    cells_get_size(width, height);
+}
+
+static void curses_scroll(int top, int bottom, int delta)
+{
+    /* The terminal only scrolls if scrolling is enabled, but leaving it
+        enabled would let curses scroll the whole screen when something
+        is drawn in the bottom right corner. */
+    scrollok(stdscr, TRUE);
+    setscrreg(top, bottom);
+    scrl(delta);
+    setscrreg(0, LINES-1);
+    scrollok(stdscr, FALSE);
+
+    cells_scroll(top, bottom, delta);
+}
+
+static void curses_flush(int repaint)
+{
+    int jx, beg;
+
+    if (curses_restarted) {
+        /* Curses has forgotten everything, so send it all again. */
+        curses_restarted = FALSE;
+        cells_damage_all();
+    }
+
+    for (jx=0; jx<cells_height; jx++) {
+        beg = cells_dirtybeg[jx];
+        if (beg < 0)
+            continue;
+        mvaddchnstr(jx, beg, &cell_at(cells, jx, beg), 
+            cells_dirtyend[jx] - beg);
+    }
+    cells_undamage();
+
+    move(cells_ypos, cells_xpos);
+    if (repaint)
+        wrefresh(curscr);
+    else
+        refresh();
+}
+
+/* The terminal stays in cbreak mode throughout. The key delay is the
+    read timeout of stdscr, which curses keeps to itself; unlike 
+    halfdelay() and cbreak(), setting it doesn't touch the terminal 
+    settings, so it costs nothing to change for every key. */
+static int curses_get_key(int wait)
+{
+    wtimeout(stdscr, (wait ? curses_keydelay : 0));
+    return getch();
+}
+
+static void curses_set_key_delay(int tenths)
+{
+    /* A delay of zero (for -precise) would make waiting spin, so wait
+        a hundredth of a second instead. */
+    curses_keydelay = (tenths > 0) ? tenths * 100 : 10;
+}
+
+static int curses_input_fd()
+{
+    return 0; /* newterm() was given stdin. */
+}
+
+screen_t gli_screen_curses = {
+    "curses",
+    &curses_setup, &curses_reset, &curses_shutdown, &curses_get_size,
+    &cells_set_pos, &cells_set_attr, &cells_put_char, &cells_put_string,
+    &cells_put_spaces, &cells_clear_eol, &cells_clear_all,
+    &curses_scroll, &curses_flush,
+    &curses_get_key, &curses_set_key_delay, &curses_input_fd
+};
+
+/* ---- The headless backend. ---- */
+
+static void headless_setup()
+{
+    cells_setup((pref_screenwidth ? pref_screenwidth : 80),
+        (pref_screenheight ? pref_screenheight : 24));
+}
+
+static void headless_reset()
+{
+    /* The size never changes. */
+}
+
+/* Print the final screen, so that a script can see what happened. */
+static void headless_shutdown()
+{
+    int ix, jx, len;
+
+    if (!cells)
+        return;
+
+    for (jx=0; jx<cells_height; jx++) {
+        for (len=cells_width; len > 0; len--) {
+            if ((cell_at(cells, jx, len-1) & A_CHARTEXT) != ' ')
+                break;
+        }
+        for (ix=0; ix<len; ix++)
+            putchar((int)(cell_at(cells, jx, ix) & A_CHARTEXT));
+        putchar('\n');
+    }
+
+    cells_free();
+}
+
+static void headless_flush(int repaint)
+{
+    /* The cells are the screen, so there's nothing to do. */
+    cells_undamage();
+}
+
+/* Keys are read from standard input, a byte at a time. When that runs
+    out, the session is over. */
+static int headless_get_key(int wait)
+{
+    int ch = getchar();
+
+    if (ch == EOF) {
+        if (!wait)
+            return ERR;
+        gli_fast_exit();
+    }
+    return ch;
+}
+
+static void headless_set_key_delay(int tenths)
+{
+    /* Keys never have to be waited for. */
+}
+
+static int headless_input_fd()
+{
+    /* Standard input is buffered, so polling the descriptor would not
+        show what's waiting. */
+    return -1;
+}
+
+screen_t gli_screen_headless = {
+    "headless",
+    &headless_setup, &headless_reset, &headless_shutdown, &cells_get_size,
+    &cells_set_pos, &cells_set_attr, &cells_put_char, &cells_put_string,
+    &cells_put_spaces, &cells_clear_eol, &cells_clear_all,
+    &cells_scroll, &headless_flush,
+    &headless_get_key, &headless_set_key_delay, &headless_input_fd
+};
+
+#ifdef OPT_DIRECT_SCREEN
+
+/* ---- The direct backend. ---- */
+
+/* This keeps a second array of cells (the front cells) recording what
+    the terminal is showing. When the screen is flushed, the damaged 
+    cells are compared with those, and only the ones that differ are sent
+    to the terminal -- as ANSI escape sequences, all in one write(). 
+    Curses does much the same thing, but GlkTerm already knows which 
+    parts of the screen have changed, so this saves curses from working
+    it out again. */
+
+static chtype *direct_front = NULL;
+static struct termios direct_termios; /* The terminal's original mode. */
+static volatile int direct_resized; /* Set when the terminal's size may
+    have changed. */
+static int direct_keydelay = -1; /* Tenths of a second; -1 to wait 
+    forever. */
+static int direct_pendingkey = -1; /* Read ahead while looking for an
+    escape sequence. */
+
+/* The output waiting for the next write(). */
+static char *direct_out = NULL;
+static long direct_outlen = 0;
+static long direct_outsize = 0;
+
+/* Where the terminal's cursor is, or -1 if we don't know; and the 
+    attributes it will draw with. */
+static int direct_termx, direct_termy;
+static chtype direct_termattr;
+
+/* The number of unchanged cells it's worth printing again, rather than
+    moving the cursor over them. (A cursor movement is six bytes or 
+    more.) */
+#define DIRECT_SKIP_CELLS (4)
+
+static void direct_emit(char *str, long len)
+{
+    if (direct_outlen + len > direct_outsize) {
+        long newsize = direct_outsize * 2;
+        if (newsize < direct_outlen + len)
+            newsize = direct_outlen + len + 256;
+        direct_out = (char *)realloc(direct_out, newsize);
+        if (!direct_out) {
+            direct_outsize = 0;
+            direct_outlen = 0;
+            return;
+        }
+        direct_outsize = newsize;
+    }
+    memcpy(direct_out+direct_outlen, str, len);
+    direct_outlen += len;
+}
+
+static void direct_emit_str(char *str)
+{
+    direct_emit(str, strlen(str));
+}
+
+static void direct_write_out()
+{
+    long pos = 0;
+    
+    while (pos < direct_outlen) {
+        long count = write(1, direct_out+pos, direct_outlen-pos);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        pos += count;
+    }
+    direct_outlen = 0;
+}
+
+static void direct_move(int ypos, int xpos)
+{
+    char buf[32];
+    sprintf(buf, "\033[%d;%dH", ypos+1, xpos+1);
+    direct_emit_str(buf);
+    direct_termx = xpos;
+    direct_termy = ypos;
+}
+
+static void direct_set_termattr(chtype attr)
+{
+    char buf[32];
+    
+    strcpy(buf, "\033[");
+    if (direct_termattr & ~attr) {
+        /* Something has to be turned off, so start from scratch. */
+        strcat(buf, "0;");
+        direct_termattr = 0;
+    }
+    attr &= ~direct_termattr;
+    if (attr & A_BOLD)
+        strcat(buf, "1;");
+    if (attr & A_UNDERLINE)
+        strcat(buf, "4;");
+    if (attr & A_REVERSE)
+        strcat(buf, "7;");
+    buf[strlen(buf)-1] = 'm';
+    direct_emit_str(buf);
+    direct_termattr |= attr;
+}
+
+/* Ask the terminal how big it is. */
+static void direct_measure(int *width, int *height)
+{
+#ifdef TIOCGWINSZ
+    struct winsize ws;
+    if (ioctl(1, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        *width = ws.ws_col;
+        *height = ws.ws_row;
+        return;
+    }
+#endif /* TIOCGWINSZ */
+    *width = 80;
+    *height = 24;
+}
+
+/* Put the terminal into the mode we want: like curses cbreak(), 
+    noecho(), and nonl(). Signal keys still work. This only calls 
+    tcsetattr(), so it's safe in a signal handler. */
+static void direct_raw_mode()
+{
+    struct termios tio;
+    
+    tio = direct_termios;
+    tio.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    tio.c_iflag &= ~(ICRNL | INLCR | IXON);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &tio);
+}
+
+#ifdef OPT_USE_SIGNALS
+
+/* Signal handler for SIGTSTP (ctrl-Z). Curses takes care of this itself;
+    we have to put the terminal back the way the shell left it, and then
+    really stop. When the process is continued, the terminal goes back
+    into our mode; the SIGCONT handler sees that the whole screen is
+    drawn again. */
+static void direct_sig_suspend(int val)
+{
+    static char leave[] = "\033[0m\033[?1049l";
+    static char enter[] = "\033[?1049h";
+    sigset_t mask;
+    
+    if (write(1, leave, sizeof(leave)-1) < 0) {
+        /* Nothing to be done about it. */
+    }
+    tcsetattr(0, TCSANOW, &direct_termios);
+    
+    signal(SIGTSTP, SIG_DFL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    kill(getpid(), SIGTSTP);
+    
+    /* The process stops here, until it is continued. */
+    
+    signal(SIGTSTP, &direct_sig_suspend);
+    direct_raw_mode();
+    if (write(1, enter, sizeof(enter)-1) < 0) {
+        /* Nothing to be done about it. */
+    }
+}
+
+#endif /* OPT_USE_SIGNALS */
+
+/* Forget what the terminal shows, and blank it. */
+static void direct_clear_front()
+{
+    long ix, count;
+    
+    count = (long)cells_width * cells_height;
+    for (ix=0; ix<count; ix++)
+        direct_front[ix] = ' ';
+    direct_emit_str("\033[0m\033[H\033[2J");
+    direct_termattr = 0;
+    direct_termx = 0;
+    direct_termy = 0;
+}
+
+static void direct_setup()
+{
+    int width, height;
+    
+    tcgetattr(0, &direct_termios);
+    direct_raw_mode();
+#ifdef OPT_USE_SIGNALS
+    signal(SIGTSTP, &direct_sig_suspend);
+#endif /* OPT_USE_SIGNALS */
+    
+    direct_measure(&width, &height);
+    cells_setup(width, height);
+    direct_front = cells_alloc();
+    direct_resized = FALSE;
+    
+    direct_emit_str("\033[?1049h"); /* the alternate screen */
+    direct_clear_front();
+    direct_write_out();
+}
+
+static void direct_reset()
+{
+    /* This is called from the SIGWINCH handler, so just make a note. */
+    direct_resized = TRUE;
+}
+
+static void direct_shutdown()
+{
+#ifdef OPT_USE_SIGNALS
+    signal(SIGTSTP, SIG_DFL);
+#endif /* OPT_USE_SIGNALS */
+    direct_emit_str("\033[0m\033[?1049l");
+    direct_write_out();
+    tcsetattr(0, TCSANOW, &direct_termios);
+    
+    free(direct_front);
+    direct_front = NULL;
+    cells_free();
+}
+
+static void direct_get_size(int *width, int *height)
+{
+    if (direct_resized) {
+        int newwidth, newheight;
+        direct_resized = FALSE;
+        direct_measure(&newwidth, &newheight);
+        if (newwidth != cells_width || newheight != cells_height) {
+            /* Everything will be redrawn for the new size. */
+            cells_setup(newwidth, newheight);
+            free(direct_front);
+            direct_front = cells_alloc();
+            direct_clear_front();
+        }
+    }
+    cells_get_size(width, height);
+}
+
+static void direct_scroll(int top, int bottom, int delta)
+{
+    int ix;
+    char buf[32];
+    
+    if (top < 0)
+        top = 0;
+    if (bottom >= cells_height)
+        bottom = cells_height-1;
+    if (top >= bottom || delta == 0)
+        return;
+    
+    cells_scroll(top, bottom, delta);
+    
+    /* Scroll the terminal too, since that's cheaper than drawing all the
+        lines again. New lines come in blank, so the attributes have to
+        be off. */
+    scroll_cells(direct_front, top, bottom, delta);
+    if (direct_termattr)
+        direct_set_termattr(0);
+    sprintf(buf, "\033[%d;%dr", top+1, bottom+1);
+    direct_emit_str(buf);
+    if (delta > 0) {
+        direct_move(bottom, 0);
+        for (ix=0; ix<delta; ix++)
+            direct_emit_str("\n");
+    }
+    else {
+        direct_move(top, 0);
+        for (ix=0; ix<-delta; ix++)
+            direct_emit_str("\033M");
+    }
+    /* Resetting the scroll region sends the cursor home. */
+    direct_emit_str("\033[r");
+    direct_termx = 0;
+    direct_termy = 0;
+}
+
+static void direct_flush(int repaint)
+{
+    int ix, jx, sx, blankx;
+    chtype ch;
+    char cbuf[1];
+    
+    if (repaint) {
+        /* The process may have been stopped, and the terminal used for
+            something else meanwhile; so set it up again, too. */
+        direct_raw_mode();
+        direct_emit_str("\033[?1049h");
+        direct_clear_front();
+        cells_damage_all();
+    }
+    
+    for (jx=0; jx<cells_height; jx++) {
+        if (cells_dirtybeg[jx] < 0)
+            continue;
+        
+        /* The row is blank from blankx on. */
+        for (blankx=cells_width; blankx>0; blankx--) {
+            if (cell_at(cells, jx, blankx-1) != ' ')
+                break;
+        }
+        
+        for (ix=cells_dirtybeg[jx]; ix<cells_dirtyend[jx]; ix++) {
+            ch = cell_at(cells, jx, ix);
+            if (ch == cell_at(direct_front, jx, ix))
+                continue;
+            
+            if (direct_termy != jx || direct_termx != ix) {
+                /* If the cursor is just a few cells to the left, and 
+                    they're in the right attributes, print them again 
+                    rather than moving. */
+                if (direct_termy == jx && direct_termx >= 0
+                    && direct_termx < ix 
+                    && ix - direct_termx <= DIRECT_SKIP_CELLS) {
+                    for (sx=direct_termx; sx<ix; sx++) {
+                        if ((cell_at(cells, jx, sx) & A_ATTRIBUTES) 
+                            != direct_termattr)
+                            break;
+                    }
+                }
+                else {
+                    sx = -1;
+                }
+                if (sx == ix) {
+                    for (sx=direct_termx; sx<ix; sx++) {
+                        cbuf[0] = (char)(cell_at(cells, jx, sx) & A_CHARTEXT);
+                        direct_emit(cbuf, 1);
+                    }
+                }
+                else {
+                    direct_move(jx, ix);
+                }
+            }
+            
+            if (ix >= blankx) {
+                /* Erase the rest of the row in one go. */
+                if (direct_termattr)
+                    direct_set_termattr(0);
+                direct_emit_str("\033[K");
+                for (; ix<cells_width; ix++)
+                    cell_at(direct_front, jx, ix) = ' ';
+                break;
+            }
+            
+            if ((ch & A_ATTRIBUTES) != direct_termattr)
+                direct_set_termattr(ch & A_ATTRIBUTES);
+            cbuf[0] = (char)(ch & A_CHARTEXT);
+            direct_emit(cbuf, 1);
+            cell_at(direct_front, jx, ix) = ch;
+            
+            direct_termx = ix+1;
+            direct_termy = jx;
+            if (direct_termx >= cells_width) {
+                /* Terminals differ about where the cursor is now. */
+                direct_termx = -1;
+                direct_termy = -1;
+            }
+        }
+    }
+    cells_undamage();
+    
+    /* Leave the cursor where curses would. */
+    if (cells_ypos >= 0 && cells_ypos < cells_height
+        && cells_xpos >= 0 && cells_xpos < cells_width
+        && (direct_termy != cells_ypos || direct_termx != cells_xpos))
+        direct_move(cells_ypos, cells_xpos);
+    
+    direct_write_out();
+}
+
+/* Read one byte from the terminal, waiting at most msec milliseconds
+    (or forever, if msec is negative.) Returns -1 if nothing arrived. */
+static int direct_read_byte(long msec)
+{
+    fd_set fds;
+    struct timeval tv;
+    unsigned char ch;
+    
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    if (msec >= 0) {
+        tv.tv_sec = msec / 1000;
+        tv.tv_usec = (msec % 1000) * 1000;
+    }
+    if (select(1, &fds, NULL, NULL, (msec >= 0) ? &tv : NULL) <= 0)
+        return -1;
+    if (read(0, &ch, 1) != 1)
+        return -1;
+    return ch;
+}
+
+/* Read the rest of an escape sequence (after the ESC), and turn it into
+    a curses key code. */
+static int direct_escape_key()
+{
+    int ch, num;
+    
+    ch = direct_read_byte(50);
+    if (ch != '[' && ch != 'O') {
+        /* Just the escape key. */
+        direct_pendingkey = ch;
+        return '\033';
+    }
+    
+    num = 0;
+    for (;;) {
+        ch = direct_read_byte(50);
+        if (ch < 0)
+            return ERR;
+        if (ch >= '0' && ch <= '9')
+            num = num * 10 + (ch - '0');
+        else if (ch >= 0x40 && ch <= 0x7E)
+            break;
+    }
+    
+    switch (ch) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch (num) {
+                case 1: case 7: return KEY_HOME;
+                case 2: return KEY_IC;
+                case 3: return KEY_DC;
+                case 4: case 8: return KEY_END;
+                case 5: return KEY_PPAGE;
+                case 6: return KEY_NPAGE;
+            }
+            break;
+    }
+    return ERR;
+}
+
+static int direct_get_key(int wait)
+{
+    int ch;
+    
+    if (direct_pendingkey >= 0) {
+        ch = direct_pendingkey;
+        direct_pendingkey = -1;
+    }
+    else {
+        if (!wait)
+            ch = direct_read_byte(0);
+        else if (direct_keydelay >= 0)
+            ch = direct_read_byte(direct_keydelay * 100L);
+        else
+            ch = direct_read_byte(-1);
+        if (ch < 0)
+            return ERR;
+    }
+    
+    if (ch == '\033')
+        return direct_escape_key();
+    return ch;
+}
+
+static void direct_set_key_delay(int tenths)
+{
+    direct_keydelay = tenths;
+}
+
+static int direct_input_fd()
+{
+    return 0;
+}
+
+screen_t gli_screen_direct = {
+    "direct",
+    &direct_setup, &direct_reset, &direct_shutdown, &direct_get_size,
+    &cells_set_pos, &cells_set_attr, &cells_put_char, &cells_put_string,
+    &cells_put_spaces, &cells_clear_eol, &cells_clear_all,
+    &direct_scroll, &direct_flush,
+    &direct_get_key, &direct_set_key_delay, &direct_input_fd
+};
+
+#endif /* OPT_DIRECT_SCREEN */
@@ -0,0 +1,55 @@
+/* gtscreen.h: The screen backend header
+        for GlkTerm, curses.h implementation of the Glk API.
+    Designed by Andrew Plotkin <erkyrath@eblong.com>
+    http://www.eblong.com/zarf/glk/index.html
+*/
+
+/* Everything the library draws, and every key it reads, goes through the
+    current screen backend. Drawing goes into a virtual screen in memory,
+    which keeps track of which cells have changed; the backend sends 
+    those to the terminal when the screen is flushed. The curses backend
+    is the normal one. The headless backend has no terminal at all, and 
+    reads keys from standard input, so that the library can be run (for
+    testing or timing) by a script. The direct backend sends the changes
+    straight to an ANSI terminal.
+   Attributes are curses.h attribute values for every backend, and key
+    codes are curses.h key codes. Positions are (y, x), as in curses. */
+
+typedef struct screen_struct {
+    char *name;
+
+    void (*setup)(void); /* Called once, before anything is drawn. */
+    void (*reset)(void); /* Called when the terminal size changes. */
+    void (*shutdown)(void);
+    void (*get_size)(int *width, int *height);
+
+    void (*set_pos)(int ypos, int xpos);
+    void (*set_attr)(chtype attr);
+    void (*put_char)(int ch); /* Advances the position. */
+    void (*put_string)(char *str, int len); /* Advances the position. */
+    void (*put_spaces)(int len); /* Does not advance the position. */
+    void (*clear_eol)(void);
+    void (*clear_all)(void);
+    void (*scroll)(int top, int bottom, int delta); /* Scroll lines top
+        through bottom (inclusive) up by delta lines, or down if delta is
+        negative. */
+    void (*flush)(int repaint); /* Make the screen show what's been drawn.
+        If repaint is true, assume the screen is garbage and draw all of
+        it. */
+
+    int (*get_key)(int wait); /* Returns ERR if no key arrived. */
+    void (*set_key_delay)(int tenths); /* Make waiting get_key() calls
+        time out after this long. */
+    int (*input_fd)(void); /* The file descriptor keys are read from, so
+        that the caller can poll() it and then call get_key(FALSE); or -1
+        if the only way to wait for a key is get_key(TRUE). */
+} screen_t;
+
+extern screen_t *gli_screen;
+extern screen_t gli_screen_curses;
+extern screen_t gli_screen_headless;
+#ifdef OPT_DIRECT_SCREEN
+extern screen_t gli_screen_direct;
+#endif /* OPT_DIRECT_SCREEN */
+
+extern chtype *gli_headless_cells(int *width, int *height);
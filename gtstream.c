@@ -761,7 +761,6 @@ static void gli_put_char_uni(stream_t *str, glui32 ch)
 
 static void gli_put_buffer(stream_t *str, char *buf, glui32 len)
 {
-    char *cx;
     glui32 lx;
     
     if (!str || !str->writable)
@@ -819,9 +818,7 @@ static void gli_put_buffer(stream_t *str, char *buf, glui32 len)
                 gli_strict_warning("put_buffer: window has pending line request");
                 break;
             }
-            for (lx=0, cx=buf; lx<len; lx++, cx++) {
-                gli_window_put_char(str->win, *cx);
-            }
+            gli_window_put_buffer(str->win, buf, len);
             if (str->win->echostr)
                 gli_put_buffer(str->win->echostr, buf, len);
             break;
@@ -10,6 +10,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 #include "gtw_blnk.h"
 
 /* This code is just as simple as you think. A blank window is filled with
@@ -42,14 +43,18 @@ void win_blank_redraw(window_t *win)
     window_blank_t *dwin = win->data;
 
     for (jx=win->bbox.top; jx<win->bbox.bottom; jx++) {
-        move(jx, win->bbox.left);
+        (*gli_screen->set_pos)(jx, win->bbox.left);
         for (ix=win->bbox.left; ix<win->bbox.right; ix++)
-            addch(':');
+            (*gli_screen->put_char)(':');
     }
     
-    mvaddch(win->bbox.top, win->bbox.left, '/');
-    mvaddch(win->bbox.top, win->bbox.right-1, '\\');
-    mvaddch(win->bbox.bottom-1, win->bbox.left, '\\');
-    mvaddch(win->bbox.bottom-1, win->bbox.right-1, '/');
+    (*gli_screen->set_pos)(win->bbox.top, win->bbox.left);
+    (*gli_screen->put_char)('/');
+    (*gli_screen->set_pos)(win->bbox.top, win->bbox.right-1);
+    (*gli_screen->put_char)('\\');
+    (*gli_screen->set_pos)(win->bbox.bottom-1, win->bbox.left);
+    (*gli_screen->put_char)('\\');
+    (*gli_screen->set_pos)(win->bbox.bottom-1, win->bbox.right-1);
+    (*gli_screen->put_char)('/');
 }
 
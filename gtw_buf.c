@@ -5,26 +5,89 @@
 */
 
 #include "gtoption.h"
+#if defined(OPT_SCROLLBACK_SPILL) || defined(OPT_LAYOUT_THREADS)
+#define _POSIX_C_SOURCE (200112L) /* for mmap(), ftruncate(), and threads */
+#endif /* OPT_SCROLLBACK_SPILL || OPT_LAYOUT_THREADS */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <curses.h>
+#ifdef OPT_SCROLLBACK_SPILL
+#include <unistd.h>
+#include <sys/mman.h>
+#endif /* OPT_SCROLLBACK_SPILL */
+#ifdef OPT_LAYOUT_THREADS
+#include <pthread.h>
+#endif /* OPT_LAYOUT_THREADS */
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 #include "gtw_buf.h"
 
 /* Array of curses.h attribute values, one for each style. */
 chtype win_textbuffer_styleattrs[style_NUMSTYLES];
 
-/* Maximum buffer size. The slack value is how much larger than the size 
-    we should get before we trim. */
-#define BUFFER_SIZE (5000)
-#define BUFFER_SLACK (1000)
-
-static void final_lines(window_textbuffer_t *dwin, long beg, long end);
+/* Maximum buffer size (set by the -scrollback option). The slack value is
+    how much larger than the size we should get before we trim. */
+#define BUFFER_SIZE (pref_scrollback)
+#define BUFFER_SLACK (pref_scrollback / 5)
+
+#ifdef OPT_SCROLLBACK_SPILL
+/* The spill file grows by at least this many bytes at a time. */
+#define SPILL_GROWTH (65536)
+/* Scrolling back reads in at least this many characters at a time. */
+#define SPILL_CHUNK (BUFFER_SLACK > 1000 ? BUFFER_SLACK : 1000)
+#endif /* OPT_SCROLLBACK_SPILL */
+
+#ifdef OPT_LAYOUT_THREADS
+/* Segments shorter than this many characters are always laid out in the
+    main thread; it's not worth waking the workers. */
+#define PARALLEL_LAYOUT_MIN (32768)
+/* How many pieces to split a segment into, per thread. More pieces even out
+    the load when paragraphs vary in length. */
+#define PARALLEL_LAYOUT_JOBS (2)
+/* How many lines win_textbuffer_idle_work() gets through per call. With
+    several threads doing layout, it can get through more in the same time. */
+#define IDLE_LAYOUT_LINES (500 * pref_layout_threads)
+#else /* OPT_LAYOUT_THREADS */
+/* How many lines win_textbuffer_idle_work() gets through per call. */
+#define IDLE_LAYOUT_LINES (500)
+#endif /* OPT_LAYOUT_THREADS */
+
+/* Room for command history text, in characters per entry. A long command
+    just pushes out more of the old ones. */
+#define HISTORY_CHARS (80)
+
+static void grow_chars(window_textbuffer_t *dwin, long count);
+static void grow_lines(window_textbuffer_t *dwin, long count);
+static void grow_runs(window_textbuffer_t *dwin, long count);
+static void grow_words(window_textbuffer_t *dwin, long count);
+static int init_layout(tblayout_t *lay);
+static void final_layout(tblayout_t *lay);
+static long push_tmplinewords(tblayout_t *lay, tbword_t *words, long count);
+#ifdef OPT_SCROLLBACK_SPILL
+static void spill_close(window_textbuffer_t *dwin);
+static void spill_text(window_textbuffer_t *dwin, long end);
+static int restore_spill(window_textbuffer_t *dwin);
+#endif /* OPT_SCROLLBACK_SPILL */
+static void updatetext(window_textbuffer_t *dwin);
+static int scroll_view(window_textbuffer_t *dwin, long *exposebeg, 
+    long *exposeend);
+static void draw_lines(window_textbuffer_t *dwin, long drawbeg, 
+    long drawend);
+static void clear_layout_cache(window_textbuffer_t *dwin);
+static void prune_layout_cache(window_textbuffer_t *dwin, long minpos, 
+    int wid1, int wid2);
+static void cache_old_layouts(window_textbuffer_t *dwin, int oldwid);
 static long find_style_by_pos(window_textbuffer_t *dwin, long pos);
 static long find_line_by_pos(window_textbuffer_t *dwin, long pos);
 static void set_last_run(window_textbuffer_t *dwin, glui32 style);
+static void history_store(window_textbuffer_t *dwin, char *buf, long len);
+static void history_drop_present(window_textbuffer_t *dwin);
+static void history_advance(window_textbuffer_t *dwin);
+static void history_load(window_textbuffer_t *dwin);
+static void history_save(window_textbuffer_t *dwin);
+static void history_append(char *buf, long len);
 static void import_input_line(window_textbuffer_t *dwin, void *buf, 
     int unicode, long len);
 static void export_input_line(void *buf, int unicode, long len, char *chars);
@@ -35,30 +98,50 @@ window_textbuffer_t *win_textbuffer_create(window_t *win)
     window_textbuffer_t *dwin = (window_textbuffer_t *)malloc(sizeof(window_textbuffer_t));
     dwin->owner = win;
     
+    dwin->charsstart = 0;
     dwin->numchars = 0;
     dwin->charssize = 500;
-    dwin->chars = (char *)malloc(dwin->charssize * sizeof(char));
+    dwin->charsbuf = (char *)malloc(dwin->charssize * sizeof(char));
+    dwin->chars = dwin->charsbuf;
     
     dwin->numlines = 0;
     dwin->linessize = 50;
-    dwin->lines = (tbline_t *)malloc(dwin->linessize * sizeof(tbline_t));
+    dwin->linesbuf = (tbline_t *)malloc(dwin->linessize * sizeof(tbline_t));
+    dwin->lines = dwin->linesbuf;
     
     dwin->numruns = 0;
     dwin->runssize = 40;
-    dwin->runs = (tbrun_t *)malloc(dwin->runssize * sizeof(tbrun_t));
-    
-    dwin->tmplinessize = 40;
-    dwin->tmplines = (tbline_t *)malloc(dwin->tmplinessize * sizeof(tbline_t));
-    
-    dwin->tmpwordssize = 40;
-    dwin->tmpwords = (tbword_t *)malloc(dwin->tmpwordssize * sizeof(tbword_t));
-    
-    if (!dwin->chars || !dwin->runs || !dwin->lines 
-        || !dwin->tmplines || !dwin->tmpwords)
+    dwin->runsbuf = (tbrun_t *)malloc(dwin->runssize * sizeof(tbrun_t));
+    dwin->runs = dwin->runsbuf;
+    
+    dwin->wordsstart = 0;
+    dwin->numwords = 0;
+    dwin->wordssize = 200;
+    dwin->wordsbuf = (tbword_t *)malloc(dwin->wordssize * sizeof(tbword_t));
+    dwin->words = dwin->wordsbuf;
+    
+#ifdef OPT_SCROLLBACK_SPILL
+    dwin->spillfile = NULL;
+    dwin->spillmap = NULL;
+    dwin->spillmapsize = 0;
+    dwin->spillend = 0;
+#endif /* OPT_SCROLLBACK_SPILL */
+    
+    dwin->layoutcachesize = 64;
+    dwin->layoutcachecount = 0;
+    dwin->layoutcache = (tbcache_t **)malloc(dwin->layoutcachesize 
+        * sizeof(tbcache_t *));
+    
+    if (!dwin->chars || !dwin->runs || !dwin->lines || !dwin->words
+        || !init_layout(&dwin->layout) || !dwin->layoutcache)
         return NULL;
+    
+    for (ix=0; ix<dwin->layoutcachesize; ix++)
+        dwin->layoutcache[ix] = NULL;
 
     dwin->inbuf = NULL;
     dwin->inunicode = FALSE;
+    dwin->inscroll = FALSE;
     dwin->inecho = FALSE;
     dwin->intermkeys = 0;
     
@@ -66,19 +149,28 @@ window_textbuffer_t *win_textbuffer_create(window_t *win)
     dwin->runs[0].style = style_Normal;
     dwin->runs[0].pos = 0;
     
+    dwin->historypos = 0;
+    dwin->historyfirst = 0;
+    dwin->historypresent = 0;
+    dwin->historyend = 0;
     if (pref_historylen > 1) {
-        dwin->history = (char **)malloc(sizeof(char *) * pref_historylen);
-        if (!dwin->history)
+        dwin->history = (tbhistent_t *)malloc(sizeof(tbhistent_t) 
+            * pref_historylen);
+        dwin->historycharssize = pref_historylen * HISTORY_CHARS;
+        dwin->historychars = (char *)malloc(dwin->historycharssize 
+            * sizeof(char));
+        if (!dwin->history || !dwin->historychars)
             return NULL;
         for (ix=0; ix<pref_historylen; ix++)
-            dwin->history[ix] = NULL;
+            dwin->history[ix].len = -1;
+        if (pref_historyfile)
+            history_load(dwin);
     }
     else {
         dwin->history = NULL;
+        dwin->historychars = NULL;
+        dwin->historycharssize = 0;
     }
-    dwin->historypos = 0;
-    dwin->historyfirst = 0;
-    dwin->historypresent = 0;
     
     dwin->dirtybeg = -1;
     dwin->dirtyend = -1;
@@ -86,6 +178,8 @@ window_textbuffer_t *win_textbuffer_create(window_t *win)
     dwin->scrollline = 0;
     dwin->scrollpos = 0;
     dwin->lastseenline = 0;
+    dwin->drawnpos = -1;
+    dwin->stalepos = -1;
     dwin->drawall = TRUE;
     
     dwin->width = -1;
@@ -106,49 +200,393 @@ void win_textbuffer_destroy(window_textbuffer_t *dwin)
     
     dwin->owner = NULL;
     
-    if (dwin->tmplines) {
-        /* don't try to destroy tmplines; they're all invalid */
-        free(dwin->tmplines);
-        dwin->tmplines = NULL;
+    final_layout(&dwin->layout);
+    
+    if (dwin->layoutcache) {
+        clear_layout_cache(dwin);
+        free(dwin->layoutcache);
+        dwin->layoutcache = NULL;
     }
     
-    if (dwin->lines) {
-        final_lines(dwin, 0, dwin->numlines);
-        free(dwin->lines);
+    if (dwin->linesbuf) {
+        free(dwin->linesbuf);
+        dwin->linesbuf = NULL;
         dwin->lines = NULL;
     }
     
-    if (dwin->runs) {
-        free(dwin->runs);
+    if (dwin->runsbuf) {
+        free(dwin->runsbuf);
+        dwin->runsbuf = NULL;
         dwin->runs = NULL;
     }
     
-    if (dwin->chars) {
-        free(dwin->chars);
+    if (dwin->charsbuf) {
+        free(dwin->charsbuf);
+        dwin->charsbuf = NULL;
         dwin->chars = NULL;
     }
     
+    if (dwin->wordsbuf) {
+        free(dwin->wordsbuf);
+        dwin->wordsbuf = NULL;
+        dwin->words = NULL;
+    }
+    
+    if (dwin->history) {
+        free(dwin->history);
+        dwin->history = NULL;
+    }
+    
+    if (dwin->historychars) {
+        free(dwin->historychars);
+        dwin->historychars = NULL;
+    }
+    
+#ifdef OPT_SCROLLBACK_SPILL
+    spill_close(dwin);
+#endif /* OPT_SCROLLBACK_SPILL */
+    
     free(dwin);
 }
 
-static void final_lines(window_textbuffer_t *dwin, long beg, long end)
+/* The chars, lines, runs, and words arrays all slide forward through their 
+    allocated blocks as old text is trimmed. This makes room for count 
+    more entries after the numlive live ones, which begin offset entries
+    into the block. When the block is full, the live entries are slid back
+    to its start; if that doesn't leave it at least half empty, the block
+    grows. So every entry is moved at most a constant number of times
+    (amortized) before it is trimmed. Returns the (possibly moved) block,
+    and updates the size and offset. */
+static void *slide_block(void *block, long *sizeref, long *offsetref,
+    long numlive, long count, size_t elsize)
 {
-    long lx;
+    if (*offsetref + numlive + count <= *sizeref)
+        return block;
+    
+    if (*offsetref) {
+        memmove(block, (char *)block + (*offsetref) * elsize, 
+            numlive * elsize);
+        *offsetref = 0;
+    }
+    
+    if (2 * (numlive + count) > *sizeref) {
+        while (2 * (numlive + count) > *sizeref)
+            *sizeref *= 2;
+        block = realloc(block, (*sizeref) * elsize);
+    }
+    
+    return block;
+}
+
+static void grow_chars(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->chars - dwin->charsbuf;
+    dwin->charsbuf = (char *)slide_block(dwin->charsbuf, &dwin->charssize,
+        &offset, dwin->numchars - dwin->charsstart, count, sizeof(char));
+    dwin->chars = dwin->charsbuf + offset;
+}
+
+static void grow_lines(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->lines - dwin->linesbuf;
+    dwin->linesbuf = (tbline_t *)slide_block(dwin->linesbuf, 
+        &dwin->linessize, &offset, dwin->numlines, count, sizeof(tbline_t));
+    dwin->lines = dwin->linesbuf + offset;
+}
+
+static void grow_runs(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->runs - dwin->runsbuf;
+    dwin->runsbuf = (tbrun_t *)slide_block(dwin->runsbuf, &dwin->runssize,
+        &offset, dwin->numruns, count, sizeof(tbrun_t));
+    dwin->runs = dwin->runsbuf + offset;
+}
+
+static void grow_words(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->words - dwin->wordsbuf;
+    dwin->wordsbuf = (tbword_t *)slide_block(dwin->wordsbuf, 
+        &dwin->wordssize, &offset, dwin->numwords - dwin->wordsstart, count,
+        sizeof(tbword_t));
+    dwin->words = dwin->wordsbuf + offset;
+}
+
+/* Set up layout scratch space. Returns FALSE if memory ran out. */
+static int init_layout(tblayout_t *lay)
+{
+    lay->tmplinessize = 40;
+    lay->tmplines = (tbline_t *)malloc(lay->tmplinessize * sizeof(tbline_t));
+    
+    lay->numtmplinewords = 0;
+    lay->tmplinewordssize = 100;
+    lay->tmplinewords = (tbword_t *)malloc(lay->tmplinewordssize 
+        * sizeof(tbword_t));
+    
+    lay->tmpwordssize = 40;
+    lay->tmpwords = (tbword_t *)malloc(lay->tmpwordssize * sizeof(tbword_t));
+    
+    return (lay->tmplines && lay->tmplinewords && lay->tmpwords);
+}
+
+static void final_layout(tblayout_t *lay)
+{
+    if (lay->tmplines) {
+        /* don't try to destroy tmplines; they're all invalid */
+        free(lay->tmplines);
+        lay->tmplines = NULL;
+    }
+    
+    if (lay->tmplinewords) {
+        free(lay->tmplinewords);
+        lay->tmplinewords = NULL;
+    }
+    
+    if (lay->tmpwords) {
+        free(lay->tmpwords);
+        lay->tmpwords = NULL;
+    }
+}
+
+/* Append words to tmplinewords. Returns the index of the first one. */
+static long push_tmplinewords(tblayout_t *lay, tbword_t *words, long count)
+{
+    long wx = lay->numtmplinewords;
     
-    for (lx=beg; lx<end; lx++) {
-        tbline_t *ln = &(dwin->lines[lx]);
-        if (ln->words) {
-            free(ln->words);
-            ln->words = NULL;
+    if (wx + count > lay->tmplinewordssize) {
+        while (wx + count > lay->tmplinewordssize)
+            lay->tmplinewordssize *= 2;
+        lay->tmplinewords = (tbword_t *)realloc(lay->tmplinewords, 
+            lay->tmplinewordssize * sizeof(tbword_t));
+    }
+    
+    if (count)
+        memcpy(lay->tmplinewords+wx, words, count * sizeof(tbword_t));
+    lay->numtmplinewords += count;
+    
+    return wx;
+}
+
+#ifdef OPT_SCROLLBACK_SPILL
+
+/* The reverse of slide_block(): this makes room for count more entries
+    before the numlive live ones, when old text is read back in from the
+    spill file. Afterwards the live entries begin count entries into the 
+    block. */
+static void *unslide_block(void *block, long *sizeref, long *offsetref,
+    long numlive, long count, size_t elsize)
+{
+    if (*offsetref >= count)
+        return block;
+    
+    if (2 * (numlive + count) > *sizeref) {
+        while (2 * (numlive + count) > *sizeref)
+            *sizeref *= 2;
+        block = realloc(block, (*sizeref) * elsize);
+    }
+    
+    memmove((char *)block + count * elsize, 
+        (char *)block + (*offsetref) * elsize, numlive * elsize);
+    *offsetref = count;
+    
+    return block;
+}
+
+static void grow_chars_front(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->chars - dwin->charsbuf;
+    dwin->charsbuf = (char *)unslide_block(dwin->charsbuf, &dwin->charssize,
+        &offset, dwin->numchars - dwin->charsstart, count, sizeof(char));
+    dwin->chars = dwin->charsbuf + offset;
+}
+
+static void grow_runs_front(window_textbuffer_t *dwin, long count)
+{
+    long offset = dwin->runs - dwin->runsbuf;
+    dwin->runsbuf = (tbrun_t *)unslide_block(dwin->runsbuf, 
+        &dwin->runssize, &offset, dwin->numruns, count, sizeof(tbrun_t));
+    dwin->runs = dwin->runsbuf + offset;
+}
+
+static void spill_close(window_textbuffer_t *dwin)
+{
+    if (dwin->spillmap) {
+        munmap(dwin->spillmap, dwin->spillmapsize);
+        dwin->spillmap = NULL;
+    }
+    if (dwin->spillfile) {
+        fclose(dwin->spillfile);
+        dwin->spillfile = NULL;
+    }
+    dwin->spillmapsize = 0;
+    dwin->spillend = 0;
+}
+
+/* Make sure the spill file is open, mapped, and at least size bytes 
+    long. If anything goes wrong, the file is abandoned, and this returns
+    FALSE from then on. */
+static int spill_reserve(window_textbuffer_t *dwin, long size)
+{
+    long newsize;
+    void *map;
+    
+    if (dwin->spillmapsize < 0)
+        return FALSE;
+    if (size <= dwin->spillmapsize)
+        return TRUE;
+    
+    if (!dwin->spillfile) {
+        /* tmpfile() files are deleted when closed, or when we exit. */
+        dwin->spillfile = tmpfile();
+    }
+    
+    newsize = 2 * dwin->spillmapsize;
+    if (newsize < SPILL_GROWTH)
+        newsize = SPILL_GROWTH;
+    while (newsize < size)
+        newsize *= 2;
+    
+    if (dwin->spillmap) {
+        munmap(dwin->spillmap, dwin->spillmapsize);
+        dwin->spillmap = NULL;
+    }
+    
+    map = MAP_FAILED;
+    if (dwin->spillfile 
+        && ftruncate(fileno(dwin->spillfile), newsize) == 0) {
+        map = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, 
+            fileno(dwin->spillfile), 0);
+    }
+    if (map == MAP_FAILED) {
+        spill_close(dwin);
+        dwin->spillmapsize = -1;
+        return FALSE;
+    }
+    
+    dwin->spillmap = (unsigned char *)map;
+    dwin->spillmapsize = newsize;
+    return TRUE;
+}
+
+/* Save the text up to position end in the spill file, before it's 
+    trimmed. The file is only ever appended to; text which was read back 
+    in is already there. */
+static void spill_text(window_textbuffer_t *dwin, long end)
+{
+    long pos, sx;
+    unsigned char *cx;
+    
+    if (!pref_scrollback_spill)
+        return;
+    if (dwin->spillend < dwin->charsstart || end <= dwin->spillend)
+        return;
+    if (!spill_reserve(dwin, 2 * end))
+        return;
+    
+    pos = dwin->spillend;
+    sx = find_style_by_pos(dwin, pos);
+    cx = dwin->spillmap + 2 * pos;
+    for (; pos < end; pos++) {
+        while (sx+1 < dwin->numruns && pos >= dwin->runs[sx+1].pos)
+            sx++;
+        *cx++ = (unsigned char)dwin->chars[pos - dwin->charsstart];
+        *cx++ = (unsigned char)dwin->runs[sx].style;
+    }
+    
+    dwin->spillend = end;
+}
+
+/* Read a chunk of the spill file back in, in front of the text in memory,
+    and lay it out. The line which was on top stays on top; the caller 
+    can then scroll up into the new lines. Returns FALSE if there was 
+    nothing to read. */
+static int restore_spill(window_textbuffer_t *dwin)
+{
+    long oldstart, newstart, limit, pos, count, nruns, rx;
+    unsigned char *map = dwin->spillmap;
+    int style;
+    
+    oldstart = dwin->charsstart;
+    if (!map || oldstart <= 0 || dwin->spillend < oldstart)
+        return FALSE;
+    
+    /* Back up a chunk, and then a little more to the start of the 
+        paragraph, if there is one reasonably nearby. */
+    newstart = oldstart - SPILL_CHUNK;
+    if (newstart < 0)
+        newstart = 0;
+    limit = newstart - SPILL_CHUNK;
+    if (limit < 0)
+        limit = 0;
+    pos = newstart;
+    while (pos > limit && map[2*(pos-1)] != '\n')
+        pos--;
+    if (pos == 0 || map[2*(pos-1)] == '\n')
+        newstart = pos;
+    count = oldstart - newstart;
+    
+    /* Count the style runs in the chunk. If the last one has the same
+        style as runs[0], they're merged. */
+    nruns = 0;
+    style = -1;
+    for (pos=newstart; pos<oldstart; pos++) {
+        if (map[2*pos+1] != style) {
+            style = map[2*pos+1];
+            nruns++;
+        }
+    }
+    if (style == dwin->runs[0].style)
+        nruns--;
+    
+    grow_chars_front(dwin, count);
+    grow_runs_front(dwin, nruns);
+    
+    dwin->chars -= count;
+    dwin->charsstart = newstart;
+    for (pos=newstart; pos<oldstart; pos++)
+        dwin->chars[pos-newstart] = (char)map[2*pos];
+    
+    dwin->runs -= nruns;
+    dwin->numruns += nruns;
+    rx = 0;
+    style = -1;
+    for (pos=newstart; pos<oldstart; pos++) {
+        if (map[2*pos+1] != style) {
+            style = map[2*pos+1];
+            /* when rx reaches nruns, this is the old runs[0] */
+            dwin->runs[rx].style = style;
+            dwin->runs[rx].pos = pos;
+            rx++;
         }
     }
+    if (rx == nruns) {
+        /* The old runs[0] may have begun before oldstart. */
+        dwin->runs[nruns].pos = oldstart;
+    }
+    
+    if (dwin->dirtybeg == -1) {
+        dwin->dirtybeg = newstart;
+        dwin->dirtyend = oldstart;
+        dwin->dirtydelta = 0;
+    }
+    else {
+        dwin->dirtybeg = newstart;
+    }
+    
+    if (dwin->scrollline < dwin->numlines)
+        dwin->scrollpos = dwin->lines[dwin->scrollline].pos;
+    updatetext(dwin);
+    
+    return TRUE;
 }
 
+#endif /* OPT_SCROLLBACK_SPILL */
+
 void win_textbuffer_rearrange(window_t *win, grect_t *box)
 {
     int oldwid, oldhgt;
     window_textbuffer_t *dwin = win->data;
     dwin->owner->bbox = *box;
+    dwin->drawnpos = -1;
 
     oldwid = dwin->width;
     oldhgt = dwin->height;
@@ -156,16 +594,26 @@ void win_textbuffer_rearrange(window_t *win, grect_t *box)
     dwin->width = box->right - box->left;
     dwin->height = box->bottom - box->top;
     
-    if (oldwid != dwin->width) {
+    if (oldwid != dwin->width && dwin->numlines)
+        cache_old_layouts(dwin, oldwid);
+    
+    if (oldwid != dwin->width && pref_lazy_layout) {
+        /* All the old lines are now stale, since their width is wrong.
+            Leave them in place; updatetext() will lay out the ones on
+            the screen, and win_textbuffer_idle_work() gets to the rest. */
+        dwin->stalepos = dwin->numchars;
+        dwin->drawall = TRUE;
+    }
+    else if (oldwid != dwin->width) {
         /* Set dirty region to the whole (or visible?), and
             delta should indicate that the whole old region is changed. */
         if (dwin->dirtybeg == -1) {
-            dwin->dirtybeg = 0;
+            dwin->dirtybeg = dwin->charsstart;
             dwin->dirtyend = dwin->numchars;
             dwin->dirtydelta = 0;
         }
         else {
-            dwin->dirtybeg = 0;
+            dwin->dirtybeg = dwin->charsstart;
             dwin->dirtyend = dwin->numchars;
         }
     }
@@ -178,21 +626,34 @@ void win_textbuffer_rearrange(window_t *win, grect_t *box)
     the end of the text, so this will never be numlines or higher. */
 static long find_line_by_pos(window_textbuffer_t *dwin, long pos)
 {
-    long lx;
+    long beg, end, val;
+    tbline_t *lines = dwin->lines;
     
-    if (dwin->numlines == 0)
+    if (dwin->numlines == 0 || pos < lines[0].pos)
         return -1;
     
-    for (lx=dwin->numlines-1; lx >= 0; lx--) {
-        if (pos >= dwin->lines[lx].pos)
-            return lx;
+    /* Lines are in position order, so do a binary search, maintaining 
+            lines[beg].pos <= pos < lines[end].pos
+        (we pretend that lines[numlines].pos is infinity) */
+    
+    beg = 0;
+    end = dwin->numlines;
+    
+    while (beg+1 < end) {
+        val = (beg+end) / 2;
+        if (pos >= lines[val].pos) {
+            beg = val;
+        }
+        else {
+            end = val;
+        }
     }
     
-    return -1;
+    return beg;
 }
 
-/* Find the last stylerun for which pos >= style.pos. We know run[0].pos == 0,
-    so the result is always >= 0. */
+/* Find the last stylerun for which pos >= style.pos. We know run[0].pos
+    <= charsstart, so the result is always >= 0. */
 static long find_style_by_pos(window_textbuffer_t *dwin, long pos)
 {
     long beg, end, val;
@@ -218,13 +679,15 @@ static long find_style_by_pos(window_textbuffer_t *dwin, long pos)
     return beg;
 }
 
-/* This does layout on a segment of text, writing into tmplines. Returns
-    the number of lines laid. Assumes tmplines is entirely unused, 
-    initially. */
-static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
-    int startpara)
+/* This does layout on a segment of text, writing into lay->tmplines 
+    starting at tmplines[lx], and appending the lines' words to tmplinewords.
+    Returns the new number of tmplines. Assumes tmplines is unused from lx
+    on, initially. This only reads the window, so several threads can lay 
+    out different segments at once, each with its own scratch space. */
+static long layout_chars(window_textbuffer_t *dwin, tblayout_t *lay, 
+    long chbeg, long chend, int startpara, long lx)
 {
-    long cx, cx2, lx, rx;
+    long cx, cx2, rx;
     long numwords; 
     long linestartpos;
     char ch;
@@ -233,12 +696,12 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
     long styleendpos;
     /* cache some values */
     char *chars = dwin->chars;
+    long chstart = dwin->charsstart;
     tbrun_t *runs = dwin->runs;
     
     lastlinetype = (startpara) ? wd_EndLine : wd_Text;
     cx = chbeg;
     linestartpos = chbeg;
-    lx = 0;
     numwords = 0; /* actually number of tmpwords */
     
     rx = find_style_by_pos(dwin, chbeg);
@@ -259,13 +722,13 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
         int linewidth, widthsofar;
         int linetype = 0;
         
-        if (lx+2 >= dwin->tmplinessize) {
+        if (lx+2 >= lay->tmplinessize) {
             /* leaves room for a final line */
-            dwin->tmplinessize *= 2;
-            dwin->tmplines = (tbline_t *)realloc(dwin->tmplines, 
-                dwin->tmplinessize * sizeof(tbline_t));
+            lay->tmplinessize *= 2;
+            lay->tmplines = (tbline_t *)realloc(lay->tmplines, 
+                lay->tmplinessize * sizeof(tbline_t));
         }
-        ln = &(dwin->tmplines[lx]);
+        ln = &(lay->tmplines[lx]);
         lx++;
         
         lineover = FALSE;
@@ -282,42 +745,42 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
             if (wx >= numwords) {
                 /* suck down a new word. */
                 
-                if (wx+2 >= dwin->tmpwordssize) {
+                if (wx+2 >= lay->tmpwordssize) {
                     /* leaves room for a split word */
-                    dwin->tmpwordssize *= 2;
-                    dwin->tmpwords = (tbword_t *)realloc(dwin->tmpwords, 
-                        dwin->tmpwordssize * sizeof(tbword_t));
+                    lay->tmpwordssize *= 2;
+                    lay->tmpwords = (tbword_t *)realloc(lay->tmpwords, 
+                        lay->tmpwordssize * sizeof(tbword_t));
                 }
-                wd = &(dwin->tmpwords[wx]);
+                wd = &(lay->tmpwords[wx]);
                 wx++;
                 numwords++;
                 
-                ch = chars[cx];
+                ch = chars[cx-chstart];
                 cx2 = cx;
                 cx++;
                 if (ch == '\n') {
                     wd->type = wd_EndLine;
-                    wd->pos = cx2;
+                    wd->pos = cx2 - chbeg;
                     wd->len = 0;
                     wd->style = style;
                 }
                 else if (ch == ' ') {
                     wd->type = wd_Blank;
-                    wd->pos = cx2;
+                    wd->pos = cx2 - chbeg;
                     while (cx < chend 
-                            && cx < styleendpos && chars[cx] == ' ')
+                            && cx < styleendpos && chars[cx-chstart] == ' ')
                         cx++;
-                    wd->len = cx - (wd->pos);
+                    wd->len = cx - cx2;
                     wd->style = style;
                 }
                 else {
                     wd->type = wd_Text;
-                    wd->pos = cx2;
+                    wd->pos = cx2 - chbeg;
                     while (cx < chend 
-                            && cx < styleendpos && chars[cx] != '\n' 
-                            && chars[cx] != ' ')
+                            && cx < styleendpos && chars[cx-chstart] != '\n' 
+                            && chars[cx-chstart] != ' ')
                         cx++;
-                    wd->len = cx - (wd->pos);
+                    wd->len = cx - cx2;
                     wd->style = style;
                 }
                 
@@ -332,25 +795,25 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
             }
             else {
                 /* pull out an existing word. */
-                wd = &(dwin->tmpwords[wx]);
+                wd = &(lay->tmpwords[wx]);
                 wx++;
             }
             
             if (wd->type == wd_EndLine) {
                 lineover = TRUE;
                 lineeatto = wx;
-                lineeatpos = wd->pos+1;
+                lineeatpos = chbeg + wd->pos+1;
                 linetype = wd_EndLine;
             }
             else {
                 if (wd->type == wd_Blank 
-                        || widthsofar + wd->len <= linewidth) {
+                        || widthsofar + (long)wd->len <= linewidth) {
                     widthsofar += wd->len;
                 }
                 else {
                     /* last text word goes over. */
                     for (wx2 = wx-1; 
-                        wx2 > 0 && dwin->tmpwords[wx2-1].type == wd_Text; 
+                        wx2 > 0 && lay->tmpwords[wx2-1].type == wd_Text; 
                         wx2--) { }
                     /* wx2 is now the first text word of this group, which 
                         is to say right after the last blank word. If this
@@ -359,13 +822,13 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
                     if (wx2 > 0) {
                         lineover = TRUE;
                         lineeatto = wx2;
-                        lineeatpos = dwin->tmpwords[wx2].pos;
+                        lineeatpos = chbeg + lay->tmpwords[wx2].pos;
                         linetype = wd_Text;
                     }
                     else {
                         /* first group goes over; gotta split. But we know
                             the last word of the group is the culprit. */
-                        int extra = widthsofar + wd->len - linewidth;
+                        int extra = widthsofar + (int)wd->len - linewidth;
                         /* extra is the amount hanging outside the boundary; 
                             will be > 0. */
                         if (wd->len == extra) {
@@ -373,18 +836,18 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
                                 chop. */
                             lineover = TRUE;
                             lineeatto = wx-1;
-                            lineeatpos = wd->pos;
+                            lineeatpos = chbeg + wd->pos;
                             linetype = wd_Text;
                         }
                         else {
                             /* split the last word, creating a new one. */
                             tbword_t *wd2;
                             if (wx < numwords) {
-                                memmove(dwin->tmpwords+(wx+1), 
-                                    dwin->tmpwords+wx, 
+                                memmove(lay->tmpwords+(wx+1), 
+                                    lay->tmpwords+wx, 
                                     (numwords-wx) * sizeof(tbword_t));
                             }
-                            wd2 = &(dwin->tmpwords[wx]);
+                            wd2 = &(lay->tmpwords[wx]);
                             wx++;
                             numwords++;
                             wd->len -= extra;
@@ -394,7 +857,7 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
                             wd2->len = extra;
                             lineover = TRUE;
                             lineeatto = wx-1;
-                            lineeatpos = wd2->pos;
+                            lineeatpos = chbeg + wd2->pos;
                             linetype = wd_Text;
                         }
                     }
@@ -409,27 +872,27 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
             linetype = wd_EndPage;
         }
         
+        ln->words = push_tmplinewords(lay, lay->tmpwords, lineeatto);
+        ln->numwords = lineeatto;
         if (lineeatto) {
-            ln->words = (tbword_t *)malloc(lineeatto * sizeof(tbword_t));
-            memcpy(ln->words, dwin->tmpwords, lineeatto * sizeof(tbword_t));
-            ln->numwords = lineeatto;
+            /* make the word positions relative to the line start */
+            long delta = linestartpos - chbeg;
+            for (wx2=0; wx2<lineeatto; wx2++)
+                lay->tmplinewords[ln->words+wx2].pos -= delta;
             
             if (lineeatto < numwords) {
-                memmove(dwin->tmpwords, 
-                    dwin->tmpwords+lineeatto, 
+                memmove(lay->tmpwords, 
+                    lay->tmpwords+lineeatto, 
                     (numwords-lineeatto) * sizeof(tbword_t));
             }
             numwords -= lineeatto;
         }
-        else {
-            ln->words = NULL;
-            ln->numwords = 0;
-        }
         ln->pos = linestartpos;
+        ln->width = dwin->width;
         ln->len = 0;
         ln->printwords = 0;
         for (wx2=0; wx2<ln->numwords; wx2++) {
-            tbword_t *wd2 = &(ln->words[wx2]);
+            tbword_t *wd2 = &(lay->tmplinewords[ln->words+wx2]);
             ln->len += wd2->len;
             if (wd2->type != wd_EndLine && ln->len <= linewidth)
                 ln->printwords = wx2+1;
@@ -445,29 +908,529 @@ static long layout_chars(window_textbuffer_t *dwin, long chbeg, long chend,
     return lx;
 }
 
+/* Copy numlines lines, moving their positions by posdelta and their word
+    indexes by wordsdelta. (Word positions are relative to the line, so they
+    stay put.) */
+static void copy_lines(tbline_t *dest, tbline_t *src, long numlines, 
+    long posdelta, long wordsdelta)
+{
+    long lx;
+    
+    for (lx=0; lx<numlines; lx++) {
+        dest[lx] = src[lx];
+        dest[lx].pos += posdelta;
+        dest[lx].words += wordsdelta;
+    }
+}
+
+static void free_cache_entry(tbcache_t *ent)
+{
+    if (ent->words)
+        free(ent->words);
+    free(ent->lines);
+    free(ent->chars);
+    free(ent->runs);
+    free(ent);
+}
+
+static void clear_layout_cache(window_textbuffer_t *dwin)
+{
+    long bx;
+    tbcache_t *ent, *next;
+    
+    for (bx=0; bx<dwin->layoutcachesize; bx++) {
+        for (ent=dwin->layoutcache[bx]; ent; ent=next) {
+            next = ent->next;
+            free_cache_entry(ent);
+        }
+        dwin->layoutcache[bx] = NULL;
+    }
+    dwin->layoutcachecount = 0;
+}
+
+/* Drop the cache entries for paragraphs which start before minpos, and 
+    those laid out at any width but wid1 and wid2. (If wid1 is -1, entries
+    of every width are kept.) */
+static void prune_layout_cache(window_textbuffer_t *dwin, long minpos, 
+    int wid1, int wid2)
+{
+    long bx;
+    tbcache_t *ent, **entptr;
+    
+    for (bx=0; bx<dwin->layoutcachesize; bx++) {
+        entptr = &(dwin->layoutcache[bx]);
+        while (*entptr) {
+            ent = *entptr;
+            if (ent->pos < minpos || (wid1 != -1 
+                && ent->width != wid1 && ent->width != wid2)) {
+                *entptr = ent->next;
+                free_cache_entry(ent);
+                dwin->layoutcachecount--;
+            }
+            else {
+                entptr = &(ent->next);
+            }
+        }
+    }
+}
+
+/* The number of style runs which cover [chbeg, chend). Sets *firstrun to
+    the first of them. */
+static long count_para_runs(window_textbuffer_t *dwin, long chbeg, 
+    long chend, long *firstrun)
+{
+    long rx, count;
+    
+    rx = find_style_by_pos(dwin, chbeg);
+    *firstrun = rx;
+    for (count = 1, rx++; rx < dwin->numruns && dwin->runs[rx].pos < chend;
+        rx++)
+        count++;
+    return count;
+}
+
+/* Return TRUE if the cache entry was laid out, at the current width, from
+    exactly the characters and style runs of [chbeg, chend). */
+static int para_matches(window_textbuffer_t *dwin, tbcache_t *ent, 
+    long chbeg, long chend)
+{
+    long ix, rx, numruns;
+    char *chars = dwin->chars - dwin->charsstart;
+    tbrun_t *runs = dwin->runs;
+    
+    if (ent->pos != chbeg || ent->len != chend - chbeg 
+        || ent->width != dwin->width)
+        return FALSE;
+    if (memcmp(ent->chars, chars+chbeg, ent->len))
+        return FALSE;
+    
+    numruns = count_para_runs(dwin, chbeg, chend, &rx);
+    if (numruns != ent->numruns)
+        return FALSE;
+    if (runs[rx].style != ent->runs[0].style)
+        return FALSE;
+    for (ix=1; ix<numruns; ix++) {
+        if (runs[rx+ix].style != ent->runs[ix].style
+            || runs[rx+ix].pos - chbeg != ent->runs[ix].pos)
+            return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/* Add lines[lx, endlx), the layout of the paragraph [chbeg, chend), to the
+    cache. */
+static void cache_para(window_textbuffer_t *dwin, long chbeg, long chend, 
+    long lx, long endlx)
+{
+    long bx, wbeg, wend, ix, rx, numruns;
+    tbcache_t *ent;
+    char *chars = dwin->chars - dwin->charsstart;
+    
+    if (dwin->layoutcachecount >= 2 * dwin->layoutcachesize) {
+        /* rehash into twice as many buckets */
+        long newsize = 2 * dwin->layoutcachesize;
+        tbcache_t **newcache = (tbcache_t **)malloc(newsize 
+            * sizeof(tbcache_t *));
+        tbcache_t *next;
+        if (newcache) {
+            for (bx=0; bx<newsize; bx++)
+                newcache[bx] = NULL;
+            for (bx=0; bx<dwin->layoutcachesize; bx++) {
+                for (ent=dwin->layoutcache[bx]; ent; ent=next) {
+                    next = ent->next;
+                    ent->next = newcache[ent->pos % newsize];
+                    newcache[ent->pos % newsize] = ent;
+                }
+            }
+            free(dwin->layoutcache);
+            dwin->layoutcache = newcache;
+            dwin->layoutcachesize = newsize;
+        }
+    }
+    
+    ent = (tbcache_t *)malloc(sizeof(tbcache_t));
+    if (!ent)
+        return;
+    wbeg = dwin->lines[lx].words;
+    wend = dwin->lines[endlx-1].words + dwin->lines[endlx-1].numwords;
+    numruns = count_para_runs(dwin, chbeg, chend, &rx);
+    ent->lines = (tbline_t *)malloc((endlx - lx) * sizeof(tbline_t));
+    ent->words = NULL;
+    if (wend > wbeg)
+        ent->words = (tbword_t *)malloc((wend - wbeg) * sizeof(tbword_t));
+    ent->chars = (char *)malloc((chend - chbeg) * sizeof(char));
+    ent->runs = (tbrun_t *)malloc(numruns * sizeof(tbrun_t));
+    if (!ent->lines || (wend > wbeg && !ent->words) || !ent->chars 
+        || !ent->runs) {
+        if (ent->lines)
+            free(ent->lines);
+        if (ent->words)
+            free(ent->words);
+        if (ent->chars)
+            free(ent->chars);
+        if (ent->runs)
+            free(ent->runs);
+        free(ent);
+        return;
+    }
+    ent->pos = chbeg;
+    ent->len = chend - chbeg;
+    memcpy(ent->chars, chars+chbeg, ent->len);
+    ent->numruns = numruns;
+    for (ix=0; ix<numruns; ix++) {
+        ent->runs[ix].style = dwin->runs[rx+ix].style;
+        ent->runs[ix].pos = dwin->runs[rx+ix].pos - chbeg;
+    }
+    ent->runs[0].pos = 0;
+    ent->width = dwin->lines[lx].width;
+    ent->numlines = endlx - lx;
+    copy_lines(ent->lines, &(dwin->lines[lx]), ent->numlines, -chbeg, -wbeg);
+    if (wend > wbeg)
+        memcpy(ent->words, &(dwin->words[wbeg-dwin->wordsstart]), 
+            (wend - wbeg) * sizeof(tbword_t));
+    
+    bx = chbeg % dwin->layoutcachesize;
+    ent->next = dwin->layoutcache[bx];
+    dwin->layoutcache[bx] = ent;
+    dwin->layoutcachecount++;
+}
+
+/* The window is about to change from width oldwid, so cache the layouts of
+    the whole paragraphs that were laid out at that width, in case it comes
+    back. Only the outgoing and incoming widths are kept; entries for any
+    others are dropped. */
+static void cache_old_layouts(window_textbuffer_t *dwin, int oldwid)
+{
+    long lx, nx, ix, pbeg, pend;
+    tbcache_t *ent;
+    tbline_t *lines = dwin->lines;
+    
+    prune_layout_cache(dwin, dwin->charsstart, oldwid, dwin->width);
+    
+    for (lx = 0; lx < dwin->numlines; lx = nx) {
+        for (nx = lx+1; nx < dwin->numlines && !lines[nx].startpara; nx++) { }
+        if (nx >= dwin->numlines) {
+            /* The last paragraph is unfinished (or is the empty line after
+                the final newline.) */
+            break;
+        }
+        pbeg = lines[lx].pos;
+        pend = lines[nx].pos;
+        if (dwin->dirtybeg != -1 && pend > dwin->dirtybeg) {
+            /* The lines from here on are out of date. */
+            break;
+        }
+        if (!lines[lx].startpara)
+            continue;
+        for (ix = lx; ix < nx && lines[ix].width == oldwid; ix++) { }
+        if (ix < nx)
+            continue;
+        for (ent = dwin->layoutcache[pbeg % dwin->layoutcachesize]; 
+            ent; ent = ent->next) {
+            if (ent->pos == pbeg && ent->width == oldwid)
+                break;
+        }
+        if (!ent)
+            cache_para(dwin, pbeg, pend, lx, nx);
+    }
+}
+
+#ifdef OPT_LAYOUT_THREADS
+
+/* One piece of a segment being laid out in parallel, and its results. */
+typedef struct layoutjob_struct {
+    long chbeg, chend;
+    int startpara;
+    long numlines;
+    tblayout_t lay;
+} layoutjob_t;
+
+/* The worker pool is shared by all windows, and started the first time it's
+    needed. The main thread does jobs too, so there are 
+    (pref_layout_threads - 1) workers. Everything here is protected by
+    pool_lock. */
+static int pool_started = FALSE; /* -1 if the pool could not be started. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static window_textbuffer_t *pool_dwin = NULL; /* Window being laid out. */
+static layoutjob_t *pool_jobs = NULL;
+static int pool_maxjobs = 0;
+static int pool_numjobs = 0; /* Jobs in the current batch. */
+static int pool_nextjob = 0; /* First job nobody has taken yet. */
+static int pool_jobsleft = 0; /* Jobs not finished yet. */
+
+static void run_layout_job(window_textbuffer_t *dwin, layoutjob_t *job)
+{
+    job->lay.numtmplinewords = 0;
+    job->numlines = layout_chars(dwin, &job->lay, job->chbeg, job->chend, 
+        job->startpara, 0);
+}
+
+/* Take jobs until the batch is used up. Called with pool_lock held; returns
+    with it held. */
+static void take_layout_jobs(void)
+{
+    window_textbuffer_t *dwin;
+    layoutjob_t *job;
+    
+    while (pool_nextjob < pool_numjobs) {
+        dwin = pool_dwin;
+        job = &(pool_jobs[pool_nextjob]);
+        pool_nextjob++;
+        pthread_mutex_unlock(&pool_lock);
+        run_layout_job(dwin, job);
+        pthread_mutex_lock(&pool_lock);
+        pool_jobsleft--;
+        if (pool_jobsleft == 0)
+            pthread_cond_signal(&pool_done);
+    }
+}
+
+static void *layout_worker(void *rock)
+{
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pool_nextjob >= pool_numjobs)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        take_layout_jobs();
+    }
+    return NULL;
+}
+
+/* Returns TRUE if there's at least one worker to share layout with. */
+static int start_layout_pool(void)
+{
+    int ix, numthreads;
+    pthread_t thread;
+    
+    if (pool_started)
+        return (pool_started > 0);
+    pool_started = -1;
+    
+    pool_maxjobs = PARALLEL_LAYOUT_JOBS * pref_layout_threads;
+    pool_jobs = (layoutjob_t *)malloc(pool_maxjobs * sizeof(layoutjob_t));
+    if (!pool_jobs)
+        return FALSE;
+    for (ix=0; ix<pool_maxjobs; ix++) {
+        if (!init_layout(&(pool_jobs[ix].lay)))
+            return FALSE;
+    }
+    
+    numthreads = 0;
+    for (ix=1; ix<pref_layout_threads; ix++) {
+        if (pthread_create(&thread, NULL, &layout_worker, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        numthreads++;
+    }
+    if (!numthreads)
+        return FALSE;
+    
+    pool_started = TRUE;
+    return TRUE;
+}
+
+/* Lay out a segment of text into dwin->layout, like layout_chars(), but 
+    split at paragraph boundaries and shared out among the worker threads.
+    Returns the number of lines laid, or -1 if the segment isn't worth
+    splitting up (or can't be). This doesn't use the layout cache. */
+static long layout_parallel(window_textbuffer_t *dwin, long chbeg, 
+    long chend, int startpara)
+{
+    tblayout_t *lay = &(dwin->layout);
+    char *chars = dwin->chars - dwin->charsstart;
+    long pbeg, pend, chunk, lx, jlx, wbeg;
+    int jx, numjobs;
+    layoutjob_t *job;
+    
+    if (pref_layout_threads < 2 || chend - chbeg < PARALLEL_LAYOUT_MIN)
+        return -1;
+    if (!start_layout_pool())
+        return -1;
+    
+    /* Each job but the last ends just after a newline, so that its text
+        lays out the same way it would as part of the whole. */
+    chunk = (chend - chbeg) / pool_maxjobs;
+    numjobs = 0;
+    for (pbeg = chbeg; pbeg < chend; pbeg = pend) {
+        if (numjobs+1 >= pool_maxjobs) {
+            pend = chend;
+        }
+        else {
+            pend = pbeg + chunk;
+            if (pend > chend)
+                pend = chend;
+            while (pend < chend && chars[pend-1] != '\n')
+                pend++;
+        }
+        job = &(pool_jobs[numjobs]);
+        numjobs++;
+        job->chbeg = pbeg;
+        job->chend = pend;
+        job->startpara = (pbeg == chbeg) ? startpara : TRUE;
+    }
+    if (numjobs < 2)
+        return -1;
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_dwin = dwin;
+    pool_numjobs = numjobs;
+    pool_nextjob = 0;
+    pool_jobsleft = numjobs;
+    pthread_cond_broadcast(&pool_wake);
+    take_layout_jobs();
+    while (pool_jobsleft > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pool_numjobs = 0;
+    pool_nextjob = 0;
+    pool_dwin = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    
+    /* Splice the results together, in order. */
+    lay->numtmplinewords = 0;
+    lx = 0;
+    for (jx=0; jx<numjobs; jx++) {
+        job = &(pool_jobs[jx]);
+        jlx = job->numlines;
+        if (jx+1 < numjobs) {
+            /* Drop the empty line after the job's last newline; the next
+                job starts there. */
+            jlx--;
+        }
+        while (lx + jlx + 2 >= lay->tmplinessize) {
+            lay->tmplinessize *= 2;
+            lay->tmplines = (tbline_t *)realloc(lay->tmplines, 
+                lay->tmplinessize * sizeof(tbline_t));
+        }
+        wbeg = push_tmplinewords(lay, job->lay.tmplinewords, 
+            job->lay.numtmplinewords);
+        copy_lines(&(lay->tmplines[lx]), job->lay.tmplines, jlx, 0, wbeg);
+        lx += jlx;
+    }
+    
+    return lx;
+}
+
+#endif /* OPT_LAYOUT_THREADS */
+
+/* Lay out a segment of text, like layout_chars(), but taking the layouts
+    of whole paragraphs from the cache when possible. (Or, for a long 
+    segment, on several threads at once, if the -threads option allows.)
+    Returns the number of lines laid. */
+static long layout_paras(window_textbuffer_t *dwin, long chbeg, long chend,
+    int startpara)
+{
+    long lx, pbeg, pend, missbeg, wbeg;
+    tbcache_t *ent;
+    tblayout_t *lay = &(dwin->layout);
+    char *chars = dwin->chars - dwin->charsstart;
+    
+#ifdef OPT_LAYOUT_THREADS
+    lx = layout_parallel(dwin, chbeg, chend, startpara);
+    if (lx >= 0)
+        return lx;
+#endif /* OPT_LAYOUT_THREADS */
+    
+    lx = 0;
+    lay->numtmplinewords = 0;
+    
+    if (!dwin->layoutcachecount)
+        return layout_chars(dwin, lay, chbeg, chend, startpara, lx);
+    
+    /* Paragraphs not in the cache are laid out together, from missbeg, 
+        when the next cached one turns up. */
+    missbeg = chbeg;
+    
+    for (pbeg = chbeg; pbeg < chend; pbeg = pend) {
+        for (pend = pbeg; pend < chend && chars[pend] != '\n'; pend++) { }
+        if (pend >= chend) {
+            /* The last paragraph is unfinished, so it can't be cached. */
+            break;
+        }
+        pend++;
+        
+        for (ent = dwin->layoutcache[pbeg % dwin->layoutcachesize]; 
+            ent; ent = ent->next) {
+            if (para_matches(dwin, ent, pbeg, pend))
+                break;
+        }
+        if (!ent)
+            continue;
+        
+        if (missbeg < pbeg) {
+            lx = layout_chars(dwin, lay, missbeg, pbeg, startpara, lx);
+            /* Since that text ends with a newline, the last line laid is
+                an empty one at pbeg. Drop that; the cached paragraph 
+                starts there. */
+            lx--;
+            startpara = TRUE;
+        }
+        
+        while (lx + ent->numlines + 2 >= lay->tmplinessize) {
+            lay->tmplinessize *= 2;
+            lay->tmplines = (tbline_t *)realloc(lay->tmplines, 
+                lay->tmplinessize * sizeof(tbline_t));
+        }
+        wbeg = push_tmplinewords(lay, ent->words, 
+            ent->lines[ent->numlines-1].words 
+            + ent->lines[ent->numlines-1].numwords);
+        copy_lines(&(lay->tmplines[lx]), ent->lines, ent->numlines, pbeg,
+            wbeg);
+        lay->tmplines[lx].startpara = startpara;
+        lx += ent->numlines;
+        
+        startpara = TRUE;
+        missbeg = pend;
+    }
+    
+    /* Lay out whatever is left: the paragraphs after the last cached one,
+        and the unfinished paragraph or empty line at the end. */
+    return layout_chars(dwin, lay, missbeg, chend, startpara, lx);
+}
+
 /* Replace lines[oldbeg, oldend) with tmplines[0, newnum). The replaced lines
     are deleted; the tmplines array winds up invalid (so it will not need to
     be deleted.) */
 static void replace_lines(window_textbuffer_t *dwin, long oldbeg, long oldend,
     long newnum)
 {
-    long lx, diff;
+    long lx, diff, wbeg, wend, wdiff;
     tbline_t *lines; /* cache */
     
     diff = newnum - (oldend - oldbeg);
     /* diff is the amount which lines will grow or shrink. */
     
-    if (dwin->numlines+diff > dwin->linessize) {
-        while (dwin->numlines+diff > dwin->linessize)
-            dwin->linessize *= 2;
-        dwin->lines = (tbline_t *)realloc(dwin->lines, 
-            dwin->linessize * sizeof(tbline_t));
-    }
-    
-    if (oldend > oldbeg)
-        final_lines(dwin, oldbeg, oldend);
+    /* The words of the replaced lines are [wbeg, wend); the new lines' 
+        words go in their place. */
+    wbeg = (oldbeg < dwin->numlines) ? dwin->lines[oldbeg].words 
+        : dwin->numwords;
+    wend = (oldend < dwin->numlines) ? dwin->lines[oldend].words 
+        : dwin->numwords;
+    wdiff = dwin->layout.numtmplinewords - (wend - wbeg);
+    
+    if (wdiff > 0)
+        grow_words(dwin, wdiff);
+    if (wdiff != 0 && wend < dwin->numwords) {
+        memmove(&(dwin->words[wend+wdiff-dwin->wordsstart]), 
+            &(dwin->words[wend-dwin->wordsstart]), 
+            (dwin->numwords - wend) * sizeof(tbword_t));
+    }
+    dwin->numwords += wdiff;
+    if (dwin->layout.numtmplinewords)
+        memcpy(&(dwin->words[wbeg-dwin->wordsstart]), dwin->layout.tmplinewords,
+            dwin->layout.numtmplinewords * sizeof(tbword_t));
+    
+    if (diff > 0)
+        grow_lines(dwin, diff);
     
     lines = dwin->lines;
+    
+    if (wdiff != 0) {
+        for (lx=oldend; lx<dwin->numlines; lx++)
+            lines[lx].words += wdiff;
+    }
 
     if (diff != 0) {
         /* diff may be positive or negative */
@@ -477,8 +1440,12 @@ static void replace_lines(window_textbuffer_t *dwin, long oldbeg, long oldend,
     }
     dwin->numlines += diff;
     
-    if (newnum)
-        memcpy(&(lines[oldbeg]), dwin->tmplines, newnum * sizeof(tbline_t));
+    if (newnum) {
+        memcpy(&(lines[oldbeg]), dwin->layout.tmplines, 
+            newnum * sizeof(tbline_t));
+        for (lx=oldbeg; lx<oldbeg+newnum; lx++)
+            lines[lx].words += wbeg;
+    }
         
     if (dwin->scrollline > oldend) {
         dwin->scrollline += diff;
@@ -506,9 +1473,82 @@ static void replace_lines(window_textbuffer_t *dwin, long oldbeg, long oldend,
         dwin->scrollline = 0;
 }
 
+/* Lay out again the whole paragraph containing line lx, which is stale,
+    along with the paragraphs covering (about) extra lines before it. 
+    Returns the index of the first line laid out. If onscreen is not NULL,
+    it's set to whether any of the old lines were on the screen. */
+static long relayout_para(window_textbuffer_t *dwin, long lx, long extra,
+    int *onscreen)
+{
+    long lnbeg, lnend, chbeg, chend, numtmplines;
+    int seenall;
+    tbline_t *lines = dwin->lines;
+    
+    lnbeg = lx - extra;
+    if (lnbeg < 0)
+        lnbeg = 0;
+    while (lnbeg > 0 && !lines[lnbeg].startpara)
+        lnbeg--;
+    lnend = lx+1;
+    while (lnend < dwin->numlines && !lines[lnend].startpara)
+        lnend++;
+    
+    if (onscreen) {
+        *onscreen = (lnbeg < dwin->scrollline + dwin->height
+            && lnend > dwin->scrollline);
+    }
+    
+    chbeg = lines[lnbeg].pos;
+    if (lnend < dwin->numlines)
+        chend = lines[lnend].pos;
+    else
+        chend = dwin->numchars;
+    
+    numtmplines = layout_paras(dwin, chbeg, chend, lines[lnbeg].startpara);
+    if (lnend < dwin->numlines && chend > chbeg
+        && dwin->chars[chend-1-dwin->charsstart] == '\n') {
+        /* Drop the empty line at chend; the next paragraph starts there. */
+        numtmplines--;
+    }
+    
+    /* No new text has appeared, so if the player had seen it all, that's
+        still true. */
+    seenall = (dwin->lastseenline >= dwin->numlines);
+    if (dwin->scrollline < dwin->numlines)
+        dwin->scrollpos = dwin->lines[dwin->scrollline].pos;
+    replace_lines(dwin, lnbeg, lnend, numtmplines);
+    if (seenall)
+        dwin->lastseenline = dwin->numlines;
+    
+    return lnbeg;
+}
+
+/* Make sure none of the lines on the screen are stale. Returns TRUE if
+    anything had to be laid out. */
+static int freshen_view(window_textbuffer_t *dwin)
+{
+    long lx;
+    int changed = FALSE;
+    
+    lx = dwin->scrollline;
+    while (lx < dwin->numlines && lx < dwin->scrollline + dwin->height) {
+        if (dwin->lines[lx].width == dwin->width) {
+            lx++;
+            continue;
+        }
+        relayout_para(dwin, lx, 0, NULL);
+        changed = TRUE;
+        /* scrollline may have moved, so start over. */
+        lx = dwin->scrollline;
+    }
+    
+    return changed;
+}
+
 static void updatetext(window_textbuffer_t *dwin)
 {
     long drawbeg, drawend;
+    long exposebeg, exposeend;
     
     if (dwin->dirtybeg != -1) {
         long numtmplines;
@@ -526,7 +1566,8 @@ static void updatetext(window_textbuffer_t *dwin)
         /* push ahead to next newline or end-of-text (still in the same
             line as dirtyend, though). move chend and oldchend in parallel,
             since (outside the changed region) nothing has changed. */
-        while (chend < dwin->numchars && dwin->chars[chend] != '\n') {
+        while (chend < dwin->numchars 
+            && dwin->chars[chend-dwin->charsstart] != '\n') {
             chend++;
             oldchend++;
         }
@@ -542,7 +1583,8 @@ static void updatetext(window_textbuffer_t *dwin)
         }
         else {
             lnbeg = 0;
-            while (chbeg && dwin->chars[chbeg-1] != '\n') {
+            while (chbeg > dwin->charsstart 
+                && dwin->chars[chbeg-1-dwin->charsstart] != '\n') {
                 chbeg--;
                 oldchbeg--;
             }
@@ -552,7 +1594,7 @@ static void updatetext(window_textbuffer_t *dwin)
         /* lnend is now the first line not to replace. [0..numlines]
             lnbeg is the first line *to* replace [0..numlines) */
         
-        numtmplines = layout_chars(dwin, chbeg, chend, startpara);
+        numtmplines = layout_paras(dwin, chbeg, chend, startpara);
         dwin->dirtybeg = -1;
         dwin->dirtyend = -1;
         dwin->dirtydelta = -1;
@@ -576,23 +1618,98 @@ static void updatetext(window_textbuffer_t *dwin)
         drawend = 0;
     }
     
+    if (dwin->stalepos >= 0 && freshen_view(dwin))
+        dwin->drawall = TRUE;
+    
+    if (!dwin->drawall && !scroll_view(dwin, &exposebeg, &exposeend))
+        dwin->drawall = TRUE;
+    
     if (dwin->drawall) {
         drawbeg = dwin->scrollline;
         drawend = dwin->scrollline + dwin->height;
+        exposebeg = 0;
+        exposeend = 0;
         dwin->drawall = FALSE;
     }
     
+    draw_lines(dwin, drawbeg, drawend);
+    draw_lines(dwin, exposebeg, exposeend);
+    
+    if (dwin->height > 0 && dwin->scrollline < dwin->numlines)
+        dwin->drawnpos = dwin->lines[dwin->scrollline].pos;
+    else
+        dwin->drawnpos = -1;
+}
+
+/* If the window has scrolled since it was last drawn, move what's on the
+    screen to match, using the terminal's scrolling, and set 
+    [*exposebeg, *exposeend) to the lines which scrolled into view. Returns
+    FALSE if the whole window has to be drawn instead. */
+static int scroll_view(window_textbuffer_t *dwin, long *exposebeg, 
+    long *exposeend)
+{
+    long oldtop, delta;
+    int orgy;
+    grect_t *box = &(dwin->owner->bbox);
+    
+    *exposebeg = 0;
+    *exposeend = 0;
+    
+    if (dwin->drawnpos < 0)
+        return FALSE;
+    if (dwin->scrollline < dwin->numlines 
+        && dwin->lines[dwin->scrollline].pos == dwin->drawnpos)
+        return TRUE;
+    
+    oldtop = find_line_by_pos(dwin, dwin->drawnpos);
+    if (oldtop < 0 || dwin->lines[oldtop].pos != dwin->drawnpos)
+        return FALSE;
+    delta = dwin->scrollline - oldtop;
+    if (delta >= dwin->height || -delta >= dwin->height)
+        return FALSE;
+    /* Curses scrolls whole screen lines, so this only works if nothing 
+        shares them with this window. */
+    if (box->left != content_box.left || box->right != content_box.right)
+        return FALSE;
+    
+    orgy = box->top;
+    (*gli_screen->scroll)(orgy, orgy + dwin->height - 1, delta);
+    
+    if (delta > 0) {
+        *exposebeg = dwin->scrollline + dwin->height - delta;
+        *exposeend = dwin->scrollline + dwin->height;
+    }
+    else {
+        *exposebeg = dwin->scrollline;
+        *exposeend = dwin->scrollline - delta;
+    }
+    return TRUE;
+}
+
+/* Draw len characters starting at position pos, all in one style, at the
+    screen position. */
+static void draw_run(window_textbuffer_t *dwin, long pos, int len, 
+    int style)
+{
+    (*gli_screen->set_attr)(win_textbuffer_styleattrs[style]);
+    (*gli_screen->put_string)(&(dwin->chars[pos-dwin->charsstart]), len);
+}
+
+/* Draw lines [drawbeg, drawend), or the part of that which is on the 
+    screen. */
+static void draw_lines(window_textbuffer_t *dwin, long drawbeg, 
+    long drawend)
+{
+    if (drawbeg < dwin->scrollline)
+        drawbeg = dwin->scrollline;
+    if (drawend > dwin->scrollline + dwin->height)
+        drawend = dwin->scrollline + dwin->height;
+    
     if (drawend > drawbeg) {
         long lx, wx;
-        int ix;
         int physln;
         int orgx, orgy;
         
-        if (drawbeg < dwin->scrollline)
-            drawbeg = dwin->scrollline;
-        if (drawend > dwin->scrollline + dwin->height)
-            drawend = dwin->scrollline + dwin->height;
-        
         orgx = dwin->owner->bbox.left;
         orgy = dwin->owner->bbox.top;
         
@@ -601,25 +1718,39 @@ static void updatetext(window_textbuffer_t *dwin)
             if (lx >= 0 && lx < dwin->numlines) {
                 tbline_t *ln = &(dwin->lines[lx]);
                 int count = 0;
-                move(orgy+physln, orgx);
+                long runpos = 0;
+                int runlen = 0;
+                int runstyle = 0;
+                (*gli_screen->set_pos)(orgy+physln, orgx);
+                /* Adjacent words in the same style are drawn as one run. */
                 for (wx=0; wx<ln->printwords; wx++) {
-                    tbword_t *wd = &(ln->words[wx]);
-                    if (wd->type == wd_Text || wd->type == wd_Blank) {
-                        unsigned char *cx = (unsigned char *)&(dwin->chars[wd->pos]);
-                        /* unsigned, so that addch() doesn't get fed any high
-                            style bits. */
-                        attrset(win_textbuffer_styleattrs[wd->style]);
-                        for (ix=0; ix<wd->len; ix++, cx++, count++)
-                            addch(*cx);
+                    tbword_t *wd = 
+                        &(dwin->words[ln->words-dwin->wordsstart+wx]);
+                    if (wd->type != wd_Text && wd->type != wd_Blank)
+                        continue;
+                    if (runlen && (wd->style != runstyle 
+                        || wd->pos != runpos+runlen)) {
+                        draw_run(dwin, ln->pos+runpos, runlen, runstyle);
+                        count += runlen;
+                        runlen = 0;
                     }
+                    if (!runlen) {
+                        runpos = wd->pos;
+                        runstyle = wd->style;
+                    }
+                    runlen += wd->len;
+                }
+                if (runlen) {
+                    draw_run(dwin, ln->pos+runpos, runlen, runstyle);
+                    count += runlen;
                 }
-                attrset(0);
-                gli_print_spaces(dwin->width - count);
+                (*gli_screen->set_attr)(0);
+                (*gli_screen->put_spaces)(dwin->width - count);
             }
             else {
                 /* blank lines at bottom */
-                move(orgy+physln, orgx);
-                gli_print_spaces(dwin->width);
+                (*gli_screen->set_pos)(orgy+physln, orgx);
+                (*gli_screen->put_spaces)(dwin->width);
             }
         }
     }
@@ -636,6 +1767,13 @@ void win_textbuffer_update(window_t *win)
 {
     window_textbuffer_t *dwin = win->data;
     updatetext(dwin);
+    
+    if (dwin->inscroll) {
+        dwin->inscroll = FALSE;
+        if (dwin->scrollline < dwin->numlines - dwin->height) {
+            gcmd_buffer_scroll(win, gcmd_DownEnd);
+        }
+    }
 }
 
 void win_textbuffer_putchar(window_t *win, char ch)
@@ -643,11 +1781,7 @@ void win_textbuffer_putchar(window_t *win, char ch)
     window_textbuffer_t *dwin = win->data;
     long lx;
     
-    if (dwin->numchars >= dwin->charssize) {
-        dwin->charssize *= 2;
-        dwin->chars = (char *)realloc(dwin->chars, 
-            dwin->charssize * sizeof(char));
-    }
+    grow_chars(dwin, 1);
     
     lx = dwin->numchars;
     
@@ -655,7 +1789,7 @@ void win_textbuffer_putchar(window_t *win, char ch)
         set_last_run(dwin, win->style);
     }
     
-    dwin->chars[lx] = ch;
+    dwin->chars[lx-dwin->charsstart] = ch;
     dwin->numchars++;
     
     if (dwin->dirtybeg == -1) {
@@ -672,6 +1806,41 @@ void win_textbuffer_putchar(window_t *win, char ch)
     }
 }
 
+/* Append a whole span of (already converted) characters, in the current
+    style. */
+void win_textbuffer_put_buffer(window_t *win, char *buf, long len)
+{
+    window_textbuffer_t *dwin = win->data;
+    long lx;
+    
+    if (len <= 0)
+        return;
+    
+    grow_chars(dwin, len);
+    
+    lx = dwin->numchars;
+    
+    if (win->style != dwin->runs[dwin->numruns-1].style) {
+        set_last_run(dwin, win->style);
+    }
+    
+    memcpy(dwin->chars+(lx-dwin->charsstart), buf, len * sizeof(char));
+    dwin->numchars += len;
+    
+    if (dwin->dirtybeg == -1) {
+        dwin->dirtybeg = lx;
+        dwin->dirtyend = lx+len;
+        dwin->dirtydelta = len;
+    }
+    else {
+        if (lx < dwin->dirtybeg)
+            dwin->dirtybeg = lx;
+        if (lx+len > dwin->dirtyend)
+            dwin->dirtyend = lx+len;
+        dwin->dirtydelta += len;
+    }
+}
+
 static void set_last_run(window_textbuffer_t *dwin, glui32 style)
 {
     long lx = dwin->numchars;
@@ -681,12 +1850,8 @@ static void set_last_run(window_textbuffer_t *dwin, glui32 style)
         dwin->runs[rx].style = style;
     }
     else {
+        grow_runs(dwin, 1);
         rx++;
-        if (rx >= dwin->runssize) {
-            dwin->runssize *= 2;
-            dwin->runs = (tbrun_t *)realloc(dwin->runs,
-                dwin->runssize * sizeof(tbrun_t));
-        }
         dwin->runs[rx].pos = lx;
         dwin->runs[rx].style = style;
         dwin->numruns++;
@@ -702,19 +1867,16 @@ static void put_text(window_textbuffer_t *dwin, char *buf, long len,
 {
     long diff = len - oldlen;
     
-    if (dwin->numchars + diff > dwin->charssize) {
-        while (dwin->numchars + diff > dwin->charssize)
-            dwin->charssize *= 2;
-        dwin->chars = (char *)realloc(dwin->chars, 
-            dwin->charssize * sizeof(char));
-    }
+    if (diff > 0)
+        grow_chars(dwin, diff);
     
     if (diff != 0 && pos+oldlen < dwin->numchars) {
-        memmove(dwin->chars+(pos+len), dwin->chars+(pos+oldlen), 
-            (dwin->numchars - (pos+oldlen) * sizeof(char)));
+        memmove(dwin->chars+(pos+len-dwin->charsstart), 
+            dwin->chars+(pos+oldlen-dwin->charsstart), 
+            (dwin->numchars - (pos+oldlen)) * sizeof(char));
     }
     if (len > 0) {
-        memmove(dwin->chars+pos, buf, len * sizeof(char));
+        memmove(dwin->chars+(pos-dwin->charsstart), buf, len * sizeof(char));
     }
     dwin->numchars += diff;
     
@@ -744,11 +1906,24 @@ void win_textbuffer_clear(window_t *win)
     window_textbuffer_t *dwin = win->data;
     long oldlen = dwin->numchars;
     
+    /* Positions start over from zero. The old lines keep their old 
+        positions until the next update replaces them all. */
+    dwin->charsstart = 0;
     dwin->numchars = 0;
+    dwin->chars = dwin->charsbuf;
+    dwin->runs = dwin->runsbuf;
     dwin->numruns = 1;
     dwin->runs[0].style = win->style;
     dwin->runs[0].pos = 0;
     
+#ifdef OPT_SCROLLBACK_SPILL
+    /* The spill file starts over too (but stays open). */
+    dwin->spillend = 0;
+#endif /* OPT_SCROLLBACK_SPILL */
+    
+    /* And the cached layouts are of positions that are gone. */
+    clear_layout_cache(dwin);
+    
     if (dwin->dirtybeg == -1) {
         dwin->dirtybeg = 0;
         dwin->dirtyend = 0;
@@ -771,14 +1946,15 @@ void win_textbuffer_trim_buffer(window_t *win)
     window_textbuffer_t *dwin = win->data;
     long trimsize;
     long lnum, snum, cnum;
-    long lx, wx, rx;
     tbline_t *ln;
     
-    if (dwin->numchars <= BUFFER_SIZE + BUFFER_SLACK)
+    if (dwin->numchars - dwin->charsstart <= BUFFER_SIZE + BUFFER_SLACK)
         return; 
         
     /* We need to knock BUFFER_SLACK chars off the beginning of the buffer, if
-        such are conveniently available. */
+        such are conveniently available. Since positions do not change, 
+        this only has to discard the old lines and slide the starts of the
+        arrays forward; the remaining text is not touched. */
         
     trimsize = dwin->numchars - BUFFER_SIZE;
     if (dwin->dirtybeg != -1 && trimsize > dwin->dirtybeg)
@@ -787,6 +1963,12 @@ void win_textbuffer_trim_buffer(window_t *win)
         trimsize = dwin->infence;
     
     lnum = find_line_by_pos(dwin, trimsize);
+    /* Whatever the -scrollback size, keep the last screenful, and the
+        text the player hasn't paged through yet. */
+    if (lnum > dwin->numlines - dwin->height)
+        lnum = dwin->numlines - dwin->height;
+    if (lnum > dwin->lastseenline - 1)
+        lnum = dwin->lastseenline - 1;
     if (lnum <= 0)
         return;
     /* The trimsize point is at the beginning of lnum, or inside it. So lnum
@@ -794,78 +1976,39 @@ void win_textbuffer_trim_buffer(window_t *win)
         
     ln = &(dwin->lines[lnum]);
     cnum = ln->pos;
-    if (cnum <= 0)
+    if (cnum <= dwin->charsstart)
         return;
     snum = find_style_by_pos(dwin, cnum);
     
+#ifdef OPT_SCROLLBACK_SPILL
+    spill_text(dwin, cnum);
+#endif /* OPT_SCROLLBACK_SPILL */
+    
     /* trim chars */
     
-    if (dwin->numchars > cnum)
-        memmove(dwin->chars, &(dwin->chars[cnum]), 
-            (dwin->numchars - cnum) * sizeof(char));
-    dwin->numchars -= cnum;
-
-    if (dwin->dirtybeg == -1) {
-        /* nothing dirty; leave it that way. */
-    }
-    else {
-        /* dirty region is after the chunk; quietly slide it back. We already
-            know that (dwin->dirtybeg >= cnum). */
-        dwin->dirtybeg -= cnum;
-        dwin->dirtyend -= cnum;
-    }
+    dwin->chars += (cnum - dwin->charsstart);
+    dwin->charsstart = cnum;
     
-    /* trim runs */
+    /* trim runs. The first remaining run may begin before cnum; that's
+        fine, since nothing asks about positions before charsstart. */
     
-    if (snum >= dwin->numruns) {
-        short sstyle = dwin->runs[snum].style;
-        dwin->runs[0].style = sstyle;
-        dwin->runs[0].pos = 0;
-        dwin->numruns = 1;
-    }
-    else {
-        for (rx=snum; rx<dwin->numruns; rx++) {
-            tbrun_t *srun2 = &(dwin->runs[rx]);
-            if (srun2->pos >= cnum)
-                srun2->pos -= cnum;
-            else
-                srun2->pos = 0;
-        }
-        memmove(dwin->runs, &(dwin->runs[snum]), 
-            (dwin->numruns - snum) * sizeof(tbrun_t));
-        dwin->numruns -= snum;
-    }
+    dwin->runs += snum;
+    dwin->numruns -= snum;
+    
+    if (dwin->layoutcachecount)
+        prune_layout_cache(dwin, cnum, -1, -1);
     
     /* trim lines */
     
-    final_lines(dwin, 0, lnum);
-    for (lx=lnum; lx<dwin->numlines; lx++) {
-        tbline_t *ln2 = &(dwin->lines[lx]);
-        ln2->pos -= cnum;
-        for (wx=0; wx<ln2->numwords; wx++) {
-            tbword_t *wd = &(ln2->words[wx]);
-            wd->pos -= cnum;
-        }
-    }
-
-    if (lnum < dwin->numlines)
-        memmove(&(dwin->lines[0]), &(dwin->lines[lnum]), 
-            (dwin->numlines - lnum) * sizeof(tbline_t));
+    dwin->words += (ln->words - dwin->wordsstart);
+    dwin->wordsstart = ln->words;
+    dwin->lines += lnum;
     dwin->numlines -= lnum;
 
     /* trim all the other assorted crap */
     
-    if (dwin->inbuf) {
-        /* there's pending line input */
-        dwin->infence -= cnum;
-        dwin->incurs -= cnum;
-    }
-    
-    if (dwin->scrollpos > cnum) {
-        dwin->scrollpos -= cnum;
-    }
-    else {
-        dwin->scrollpos = 0;
+    if (dwin->scrollpos <= cnum) {
+        dwin->scrollpos = cnum;
         dwin->drawall = TRUE;
     }
     
@@ -885,6 +2028,62 @@ void win_textbuffer_trim_buffer(window_t *win)
         dwin->scrollline = 0;
 }
 
+/* Lay out some of the stale lines, working back from the end of the text.
+    This is called when glk_select() has nothing better to do. Returns TRUE
+    if there's more to do. */
+int win_textbuffer_idle_work(window_t *win)
+{
+    window_textbuffer_t *dwin = win->data;
+    long lx, lnbeg, count, oldtop;
+    int onscreen;
+    int redraw = FALSE;
+    
+    if (dwin->stalepos < 0)
+        return FALSE;
+    if (dwin->dirtybeg != -1)
+        updatetext(dwin);
+    
+    /* Relaying out lines above the screen changes scrollline, but not
+        which line is at the top. */
+    oldtop = -1;
+    if (dwin->scrollline < dwin->numlines)
+        oldtop = dwin->lines[dwin->scrollline].pos;
+    count = 0;
+    lx = find_line_by_pos(dwin, dwin->stalepos);
+    
+    while (lx >= 0 && count < IDLE_LAYOUT_LINES) {
+        if (dwin->lines[lx].width == dwin->width) {
+            lx--;
+            count++;
+            continue;
+        }
+        /* Do the rest of this call's lines all at once, since each 
+            relayout has to shift all the lines after it. */
+        lnbeg = relayout_para(dwin, lx, IDLE_LAYOUT_LINES - count, 
+            &onscreen);
+        if (onscreen)
+            redraw = TRUE;
+        count += (lx - lnbeg) + 1;
+        lx = lnbeg - 1;
+    }
+    
+    if (lx < 0)
+        dwin->stalepos = -1;
+    else
+        dwin->stalepos = dwin->lines[lx].pos;
+    
+    if (dwin->scrollline < dwin->numlines
+        && dwin->lines[dwin->scrollline].pos != oldtop)
+        redraw = TRUE;
+    
+    if (redraw) {
+        dwin->drawall = TRUE;
+        updatetext(dwin);
+    }
+    
+    return (dwin->stalepos >= 0);
+}
+
 void win_textbuffer_place_cursor(window_t *win, int *xpos, int *ypos)
 {
     window_textbuffer_t *dwin = win->data;
@@ -942,6 +2141,8 @@ void win_textbuffer_set_paging(window_t *win, int forcetoend)
         && dwin->lastseenline - 0 < dwin->numlines - dwin->height) {
         /* scroll lastseenline to top, stick there */
         val = dwin->lastseenline - 1;
+        if (val < 0)
+            val = 0;
     }
     else {
         /* scroll to bottom, set lastseenline to end. */
@@ -957,7 +2158,7 @@ void win_textbuffer_set_paging(window_t *win, int forcetoend)
             dwin->scrollpos = dwin->numchars;
         else
             dwin->scrollpos = dwin->lines[val].pos;
-        dwin->drawall = TRUE;
+        /* updatetext() will scroll what's on the screen to match. */
         updatetext(dwin);
     }
 }
@@ -973,6 +2174,7 @@ void win_textbuffer_init_line(window_t *win, void *buf, int unicode,
     dwin->inmax = maxlen;
     dwin->infence = dwin->numchars;
     dwin->incurs = dwin->numchars;
+    dwin->inscroll = FALSE;
     dwin->inecho = win->echo_line_input;
     dwin->intermkeys = win->terminate_line_input;
     dwin->origstyle = win->style;
@@ -1002,6 +2204,9 @@ void win_textbuffer_cancel_line(window_t *win, event_t *ev)
     if (!dwin->inbuf)
         return;
 
+    /* Lay out the last keys typed, as in gcmd_buffer_accept_line(). */
+    win_textbuffer_update(win);
+
     inbuf = dwin->inbuf;
     inmax = dwin->inmax;
     inarrayrock = dwin->inarrayrock;
@@ -1010,14 +2215,16 @@ void win_textbuffer_cancel_line(window_t *win, event_t *ev)
 
     len = dwin->numchars - dwin->infence;
     if (inecho && win->echostr) 
-        gli_stream_echo_line(win->echostr, &(dwin->chars[dwin->infence]), len);
+        gli_stream_echo_line(win->echostr, 
+            &(dwin->chars[dwin->infence-dwin->charsstart]), len);
 
     /* Store in event buffer. */
         
     if (len > inmax)
         len = inmax;
         
-    export_input_line(inbuf, inunicode, len, &dwin->chars[dwin->infence]);
+    export_input_line(inbuf, inunicode, len, 
+        &dwin->chars[dwin->infence-dwin->charsstart]);
         
     if (!inecho) {
         /* Wipe the typed text from the buffer. */
@@ -1109,7 +2316,6 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
 {
     int ix;
     long len;
-    char *cx;
     void *inbuf;
     int inmax, inunicode, inecho;
     glui32 termkey = 0;
@@ -1119,6 +2325,10 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
     if (!dwin->inbuf)
         return;
     
+    /* Lay out the last keys typed (which may not have been drawn yet), 
+        so that they count as seen, as the player saw them. */
+    win_textbuffer_update(win);
+    
     inbuf = dwin->inbuf;
     inmax = dwin->inmax;
     inarrayrock = dwin->inarrayrock;
@@ -1127,30 +2337,18 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
 
     len = dwin->numchars - dwin->infence;
     if (inecho && win->echostr)
-        gli_stream_echo_line(win->echostr, &(dwin->chars[dwin->infence]), len);
+        gli_stream_echo_line(win->echostr, 
+            &(dwin->chars[dwin->infence-dwin->charsstart]), len);
     
     /* Store in history. */
-    if (len) {
-        cx = (char *)malloc((1+len) * sizeof(char));
-        memcpy(cx, &(dwin->chars[dwin->infence]), len);
-        cx[len] = '\0';
-        if (dwin->history[dwin->historypresent]) {
-            free(dwin->history[dwin->historypresent]);
-            dwin->history[dwin->historypresent] = NULL;
-        }
-        dwin->history[dwin->historypresent] = cx;
-        dwin->historypresent++;
-        if (dwin->historypresent >= pref_historylen)
-            dwin->historypresent -= pref_historylen;
-        if (dwin->historypresent == dwin->historyfirst) {
-            dwin->historyfirst++;
-            if (dwin->historyfirst >= pref_historylen)
-                dwin->historyfirst -= pref_historylen;
-        }
-        if (dwin->history[dwin->historypresent]) {
-            free(dwin->history[dwin->historypresent]);
-            dwin->history[dwin->historypresent] = NULL;
-        }
+    if (len && dwin->history) {
+        history_drop_present(dwin);
+        history_store(dwin, &(dwin->chars[dwin->infence-dwin->charsstart]), 
+            len);
+        history_advance(dwin);
+        if (pref_historyfile)
+            history_append(&(dwin->chars[dwin->infence-dwin->charsstart]), 
+                len);
     }
 
     /* Store in event buffer. */
@@ -1158,7 +2356,8 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
     if (len > inmax)
         len = inmax;
         
-    export_input_line(inbuf, inunicode, len, &dwin->chars[dwin->infence]);
+    export_input_line(inbuf, inunicode, len, 
+        &dwin->chars[dwin->infence-dwin->charsstart]);
 
     if (!inecho) {
         /* Wipe the typed text from the buffer. */
@@ -1174,6 +2373,8 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
     else
         termkey = 0;
 
+    if (pref_recordfile)
+        gli_record_line(win, inbuf, inunicode, len);
     gli_event_store(evtype_LineInput, win, len, termkey);
     win->line_request = FALSE;
     dwin->inbuf = NULL;
@@ -1190,7 +2391,9 @@ void gcmd_buffer_accept_line(window_t *win, glui32 arg)
     }
 }
 
-/* Any regular key, during line input. */
+/* Any regular key, during line input. The text isn't laid out or drawn
+    until the next update, so that a run of keys (a paste, say) is laid
+    out once, not once per key. */
 void gcmd_buffer_insert_key(window_t *win, glui32 arg)
 {
     window_textbuffer_t *dwin = win->data;
@@ -1203,11 +2406,7 @@ void gcmd_buffer_insert_key(window_t *win, glui32 arg)
         return;
     
     put_text(dwin, &ch, 1, dwin->incurs, 0);
-    updatetext(dwin);
-    
-    if (dwin->scrollline < dwin->numlines - dwin->height) {
-        gcmd_buffer_scroll(win, gcmd_DownEnd);
-    }
+    dwin->inscroll = TRUE;
 }
 
 /* Cursor movement keys, during line input. */
@@ -1275,15 +2474,15 @@ void gcmd_buffer_delete(window_t *win, glui32 arg)
             break;
     }
     
-    updatetext(dwin);
+    /* The next update will lay out what's left. */
 }
 
 /* Command history, during line input. */
 void gcmd_buffer_history(window_t *win, glui32 arg)
 {
     window_textbuffer_t *dwin = win->data;
-    char *cx;
-    int len;
+    tbhistent_t *ent;
+    long len;
     
     if (!dwin->inbuf || !dwin->history)
         return;
@@ -1293,27 +2492,19 @@ void gcmd_buffer_history(window_t *win, glui32 arg)
             if (dwin->historypos == dwin->historyfirst)
                 return;
             if (dwin->historypos == dwin->historypresent) {
+                /* Keep what's been typed so far, for when the player comes
+                    back down. */
+                history_drop_present(dwin);
                 len = dwin->numchars - dwin->infence;
-                if (len > 0) {
-                    cx = (char *)malloc((len+1) * sizeof(char));
-                    memcpy(cx, &(dwin->chars[dwin->infence]), len);
-                    cx[len] = '\0';
-                }
-                else {
-                    cx = NULL;
-                }
-                if (dwin->history[dwin->historypos])
-                    free(dwin->history[dwin->historypos]);
-                dwin->history[dwin->historypos] = cx;
+                if (len > 0)
+                    history_store(dwin, 
+                        &(dwin->chars[dwin->infence-dwin->charsstart]), len);
+                if (dwin->historypos == dwin->historyfirst)
+                    return;
             }
             dwin->historypos--;
             if (dwin->historypos < 0)
                 dwin->historypos += pref_historylen;
-            cx = dwin->history[dwin->historypos];
-            if (!cx)
-                cx = "";
-            put_text(dwin, cx, strlen(cx), dwin->infence, 
-                dwin->numchars - dwin->infence);
             break;
         case gcmd_Down:
             if (dwin->historypos == dwin->historypresent)
@@ -1321,22 +2512,216 @@ void gcmd_buffer_history(window_t *win, glui32 arg)
             dwin->historypos++;
             if (dwin->historypos >= pref_historylen)
                 dwin->historypos -= pref_historylen;
-            cx = dwin->history[dwin->historypos];
-            if (!cx)
-                cx = "";
-            put_text(dwin, cx, strlen(cx), dwin->infence, 
-                dwin->numchars - dwin->infence);
             break;
+        default:
+            return;
     }
     
+    ent = &(dwin->history[dwin->historypos]);
+    if (ent->len < 0)
+        put_text(dwin, "", 0, dwin->infence, dwin->numchars - dwin->infence);
+    else
+        put_text(dwin, dwin->historychars + ent->pos, ent->len, 
+            dwin->infence, dwin->numchars - dwin->infence);
+    
     updatetext(dwin);
 }
 
+/* Store text as the historypresent entry, which must be empty. Old entries
+    are dropped, oldest first, until there's room for it in historychars. */
+static void history_store(window_textbuffer_t *dwin, char *buf, long len)
+{
+    long beg, end;
+    tbhistent_t *ent;
+    
+    if (len > dwin->historycharssize)
+        len = dwin->historycharssize;
+    
+    for (;;) {
+        if (dwin->historyfirst == dwin->historypresent) {
+            /* Nothing else is stored; start over from the beginning. */
+            beg = 0;
+            break;
+        }
+        /* The stored text runs (circularly) from the oldest entry up to
+            historyend. */
+        ent = &(dwin->history[dwin->historyfirst]);
+        end = dwin->historyend;
+        if (end > ent->pos) {
+            if (len <= dwin->historycharssize - end) {
+                beg = end;
+                break;
+            }
+            if (len <= ent->pos) {
+                beg = 0;
+                break;
+            }
+        }
+        else {
+            if (len <= ent->pos - end) {
+                beg = end;
+                break;
+            }
+        }
+        ent->len = -1;
+        dwin->historyfirst++;
+        if (dwin->historyfirst >= pref_historylen)
+            dwin->historyfirst -= pref_historylen;
+    }
+    
+    memcpy(dwin->historychars + beg, buf, len * sizeof(char));
+    ent = &(dwin->history[dwin->historypresent]);
+    ent->pos = beg;
+    ent->len = len;
+    dwin->historyend = beg + len;
+}
+
+/* Empty the historypresent entry. (That holds the partly-typed line, if
+    the player has gone up into the history. Since it's always the last 
+    entry stored, its space can be used again.) */
+static void history_drop_present(window_textbuffer_t *dwin)
+{
+    tbhistent_t *ent = &(dwin->history[dwin->historypresent]);
+    
+    if (ent->len >= 0) {
+        dwin->historyend = ent->pos;
+        ent->len = -1;
+    }
+}
+
+/* Make the historypresent entry part of the history, and move on to a new
+    (empty) one. If the ring is full, the oldest entry is dropped. */
+static void history_advance(window_textbuffer_t *dwin)
+{
+    dwin->historypresent++;
+    if (dwin->historypresent >= pref_historylen)
+        dwin->historypresent -= pref_historylen;
+    if (dwin->historypresent == dwin->historyfirst) {
+        dwin->history[dwin->historyfirst].len = -1;
+        dwin->historyfirst++;
+        if (dwin->historyfirst >= pref_historylen)
+            dwin->historyfirst -= pref_historylen;
+    }
+}
+
+/* Read the history file, one entry per line. The file is read straight 
+    into historychars (just the end of it, if it's too long to fit), and
+    the entries are left where they land. 
+   The file only ever grows while the game runs (every window adds its
+    commands to the end), so if it holds more than fits, it's cut down
+    here to what was read. */
+static void history_load(window_textbuffer_t *dwin)
+{
+    FILE *fl;
+    long size, cx, beg, count;
+    int partial = FALSE;
+    char *chars = dwin->historychars;
+    tbhistent_t *ent;
+    
+    fl = fopen(pref_historyfile, "r");
+    if (!fl)
+        return;
+    
+    size = -1;
+    if (fseek(fl, 0, SEEK_END) == 0)
+        size = ftell(fl);
+    if (size > dwin->historycharssize) {
+        /* Only the newest entries will fit. */
+        partial = TRUE;
+        if (fseek(fl, size - dwin->historycharssize, SEEK_SET) != 0)
+            size = -1;
+        else
+            size = dwin->historycharssize;
+    }
+    else if (size >= 0) {
+        if (fseek(fl, 0, SEEK_SET) != 0)
+            size = -1;
+    }
+    if (size > 0)
+        size = fread(chars, sizeof(char), size, fl);
+    fclose(fl);
+    if (size <= 0)
+        return;
+    
+    beg = 0;
+    if (partial) {
+        /* skip the line we landed in the middle of */
+        while (beg < size && chars[beg] != '\n')
+            beg++;
+        beg++;
+    }
+    
+    count = 0;
+    for (cx=beg; cx<=size; cx++) {
+        if (cx == size || chars[cx] == '\n') {
+            if (cx > beg) {
+                ent = &(dwin->history[dwin->historypresent]);
+                ent->pos = beg;
+                ent->len = cx - beg;
+                dwin->historyend = cx;
+                history_advance(dwin);
+                count++;
+            }
+            beg = cx+1;
+        }
+    }
+    
+    /* The ring holds one entry fewer than pref_historylen, because the 
+        present entry is kept free. */
+    if (partial || count >= pref_historylen)
+        history_save(dwin);
+}
+
+/* Write out the whole history, one entry per line, replacing the file. 
+    It's not long. */
+static void history_save(window_textbuffer_t *dwin)
+{
+    FILE *fl;
+    int hx;
+    tbhistent_t *ent;
+    
+    fl = fopen(pref_historyfile, "w");
+    if (!fl)
+        return;
+    
+    for (hx = dwin->historyfirst; hx != dwin->historypresent; ) {
+        ent = &(dwin->history[hx]);
+        fwrite(dwin->historychars + ent->pos, sizeof(char), ent->len, fl);
+        putc('\n', fl);
+        hx++;
+        if (hx >= pref_historylen)
+            hx -= pref_historylen;
+    }
+    
+    fclose(fl);
+}
+
+/* Add one entry to the end of the history file. */
+static void history_append(char *buf, long len)
+{
+    FILE *fl;
+    
+    fl = fopen(pref_historyfile, "a");
+    if (!fl)
+        return;
+    
+    fwrite(buf, sizeof(char), len, fl);
+    putc('\n', fl);
+    fclose(fl);
+}
+
 /* Scrolling keys, at all times. */
 void gcmd_buffer_scroll(window_t *win, glui32 arg)
 {
     window_textbuffer_t *dwin = win->data;
     int maxval, minval, val, lval;
+#ifdef OPT_SCROLLBACK_SPILL
+    long oldline;
+#endif /* OPT_SCROLLBACK_SPILL */
+    
+    /* Lay out anything typed since the last update, so that numlines is
+        right. */
+    updatetext(dwin);
     
     minval = 0;
     maxval = dwin->numlines - dwin->height;
@@ -1366,6 +2751,26 @@ void gcmd_buffer_scroll(window_t *win, glui32 arg)
             val = dwin->scrollline;
     }
     
+#ifdef OPT_SCROLLBACK_SPILL
+    /* If the player is scrolling up past the text in memory, read some
+        back in from the spill file. Home, when we're already at the top, 
+        reads in one chunk and goes to the top of that. */
+    if (arg == gcmd_UpEnd && dwin->scrollline == minval) {
+        restore_spill(dwin);
+    }
+    else {
+        while (val < minval) {
+            oldline = dwin->scrollline;
+            if (!restore_spill(dwin))
+                break;
+            val += (dwin->scrollline - oldline);
+        }
+    }
+    maxval = dwin->numlines - dwin->height;
+    if (maxval < 0)
+        maxval = 0;
+#endif /* OPT_SCROLLBACK_SPILL */
+    
     if (val > maxval)
         val = maxval;
     if (val < minval)
@@ -1377,7 +2782,7 @@ void gcmd_buffer_scroll(window_t *win, glui32 arg)
             dwin->scrollpos = dwin->numchars;
         else
             dwin->scrollpos = dwin->lines[val].pos;
-        dwin->drawall = TRUE;
+        /* updatetext() will scroll what's on the screen to match. */
         updatetext(dwin);
     }
 
@@ -10,12 +10,13 @@
 #define wd_EndLine (3) /* End of line character */
 #define wd_EndPage (4) /* End of the whole text */
 
-/* One word */
+/* One word. These are kept small, since there are a lot of them. */
 typedef struct tbword_struct {
-    short type; /* A wd_* constant */
-    short style;
-    long pos; /* Position in the chars array. */
-    long len; /* This is zero for wd_EndLine and wd_EndPage. */
+    glui32 pos; /* Offset from the start of the line. (During layout, from
+        the start of the segment being laid out.) */
+    glui32 len; /* This is zero for wd_EndLine and wd_EndPage. */
+    unsigned char type; /* A wd_* constant */
+    unsigned char style;
 } tbword_t;
 
 /* One style run */
@@ -27,21 +28,76 @@ typedef struct tbrun_struct {
 /* One laid-out line of words */
 typedef struct tbline_struct {
     int numwords;
-    tbword_t *words;
+    long words; /* Index of the first word in the window's words array 
+        (see below), or in tmplinewords for a temporary line. */
     
-    long pos; /* Position in the chars array. */
+    long pos; /* Character position (see below). */
     long len; /* Number of characters, including blanks */
     int startpara; /* Is this line the start of a new paragraph, or is it
         wrapped? */
     int printwords; /* Number of words to actually print. (Excludes the last
         blank word, if that goes outside the window.) */
+    int width; /* The window width this was laid out for. If that's not 
+        the current width, the line is stale. */
 } tbline_t;
 
+/* A cached layout of one whole paragraph (up to and including its 
+    newline) at one width, saved when the window changed away from that
+    width. Line positions are relative to the start of the paragraph, and
+    the lines' word indexes are into the entry's words. The paragraph's 
+    text and style runs are kept too, to be sure that the text at that
+    position really is the same. */
+typedef struct tbcache_struct {
+    long pos; /* Where the paragraph starts; entries are hashed by this. */
+    long len;
+    char *chars; /* len characters. */
+    long numruns;
+    tbrun_t *runs; /* Positions relative to the start of the paragraph;
+        runs[0] is at 0. */
+    int width;
+    long numlines;
+    tbline_t *lines;
+    tbword_t *words;
+    struct tbcache_struct *next; /* In the same hash bucket. */
+} tbcache_t;
+
+/* One command history entry: a range of the window's historychars. */
+typedef struct tbhistent_struct {
+    long pos;
+    long len; /* -1 if the entry is empty. */
+} tbhistent_t;
+
+/* Scratch space for layout. Each thread doing layout has its own. */
+typedef struct tblayout_struct {
+    /* Temporary lines, and their words. */
+    tbline_t *tmplines; 
+    long tmplinessize;
+    tbword_t *tmplinewords;
+    long numtmplinewords;
+    long tmplinewordssize;
+
+    /* Temporary words; the ones not yet assigned to a line. */
+    tbword_t *tmpwords;
+    long tmpwordssize;
+} tblayout_t;
+
+/* Character positions count from the last time the window was cleared;
+    they do not change when old text is trimmed off the front of the
+    buffer. The chars, lines, and runs arrays are windows which slide 
+    forward through their allocated blocks as text is trimmed, so that
+    trimming never has to move or renumber the text that remains. 
+   The words of all the lines are kept in order in one words array, which
+    works the same way. Words are numbered from when the window was 
+    created, so a line's words index does not change when old lines are
+    trimmed. */
+
 typedef struct window_textbuffer_struct {
     window_t *owner;
     
-    char *chars;
-    long numchars;
+    char *chars; /* The live text. chars[0] is at position charsstart. */
+    long charsstart; /* Position of the first character still in memory. */
+    long numchars; /* Position just past the last character. */
+    char *charsbuf; /* The allocated block which chars points into. */
     long charssize;
     
     int width, height;
@@ -54,30 +110,59 @@ typedef struct window_textbuffer_struct {
     int drawall; /* Does the whole window need to be redrawn at the next
         update? (Set when the text is scrolled, for example.) */
     
-    tbline_t *lines;
+    tbline_t *lines; /* lines[0] is the first line still in memory. */
     long numlines;
+    tbline_t *linesbuf; /* The allocated block which lines points into. */
     long linessize;
     
-    tbrun_t *runs;
+    tbrun_t *runs; /* runs[0] covers charsstart. */
     long numruns;
+    tbrun_t *runsbuf; /* The allocated block which runs points into. */
     long runssize;
+    
+    tbword_t *words; /* words[0] is word number wordsstart. */
+    long wordsstart;
+    long numwords; /* Number just past the last word. */
+    tbword_t *wordsbuf; /* The allocated block which words points into. */
+    long wordssize;
 
-    /* Temporary lines; used during layout. */
-    tbline_t *tmplines; 
-    long tmplinessize;
+#ifdef OPT_SCROLLBACK_SPILL
+    /* Trimmed text is saved in the spill file, two bytes (character, 
+        style) per position. Every position before charsstart is in the
+        file, as long as spillend >= charsstart. */
+    FILE *spillfile; /* NULL if not opened yet. */
+    unsigned char *spillmap; /* The whole file, mapped into memory. */
+    long spillmapsize; /* In bytes; -1 if the file could not be set up. */
+    long spillend; /* Position just past the last character saved. */
+#endif /* OPT_SCROLLBACK_SPILL */
 
-    /* Temporary words; used during layout. */
-    tbword_t *tmpwords;
-    long tmpwordssize;
+    tblayout_t layout; /* Scratch space for laying out text. */
+
+    /* Paragraph layouts, so that going back to an earlier width doesn't
+        have to lay everything out again. */
+    tbcache_t **layoutcache;
+    long layoutcachesize; /* Number of buckets. */
+    long layoutcachecount; /* Number of entries. */
 
-    /* Command history. */
-    char **history;
+    /* Command history. The text of the entries is kept, oldest first, in
+        historychars, which is used as a ring; historyend is where the next
+        entry's text goes. */
+    tbhistent_t *history; /* pref_historylen entries, or NULL if there's
+        no history. */
     int historypos;
     int historyfirst, historypresent;
+    char *historychars;
+    long historycharssize;
+    long historyend;
 
     long scrollline;
     long scrollpos;
     long lastseenline;
+    long drawnpos; /* Position of the line at the top of the window, as it
+        was last drawn; -1 if the screen can't be trusted. */
+    
+    long stalepos; /* There may be stale lines up to and including the one
+        at this position, but none after. -1 if there are none at all. */
     
     /* The following are meaningful only for the current line input request. */
     void *inbuf; /* char* or glui32*, depending on inunicode. */
@@ -87,6 +172,8 @@ typedef struct window_textbuffer_struct {
     int inmax;
     long infence;
     long incurs;
+    int inscroll; /* Scroll down to the input line at the next update?
+        (Set when a key is typed.) */
     glui32 origstyle;
     gidispatch_rock_t inarrayrock;
 } window_textbuffer_t;
@@ -99,8 +186,10 @@ extern void win_textbuffer_rearrange(window_t *win, grect_t *box);
 extern void win_textbuffer_redraw(window_t *win);
 extern void win_textbuffer_update(window_t *win);
 extern void win_textbuffer_putchar(window_t *win, char ch);
+extern void win_textbuffer_put_buffer(window_t *win, char *buf, long len);
 extern void win_textbuffer_clear(window_t *win);
 extern void win_textbuffer_trim_buffer(window_t *win);
+extern int win_textbuffer_idle_work(window_t *win);
 extern void win_textbuffer_place_cursor(window_t *win, int *xpos, int *ypos);
 extern void win_textbuffer_set_paging(window_t *win, int forcetoend);
 extern void win_textbuffer_init_line(window_t *win, void *buf, int unicode, int maxlen, int initlen);
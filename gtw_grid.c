@@ -7,19 +7,23 @@
 #include "gtoption.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 #include "gtw_grid.h"
 
-/* A grid of characters. We store the window as a list of lines (see
-    gtwgrid.h); within a line, just store an array of characters and
-    an array of style bytes, the same size. (If we ever have more than
-    255 styles, things will have to be changed, but that's unlikely.)
+/* A grid of characters. We store the window as two planes, one of 
+    characters and one of style bytes, the same size; each line (see
+    gtw_grid.h) points at its row of both. (If we ever have more than 255
+    styles, things will have to be changed, but that's unlikely.)
+   The lines array and both planes are allocated as one block, so dwin->lines
+    is the only thing to free.
 */
 
-static void init_lines(window_textgrid_t *dwin, int beg, int end, int linewid);
-static void final_lines(window_textgrid_t *dwin);
+static int resize_planes(window_textgrid_t *dwin, int wid, int hgt);
+static int row_unchanged(window_textgrid_t *dwin, tgline_t *ln);
 static void export_input_line(void *buf, int unicode, long len, char *chars);
 static void import_input_line(tgline_t *ln, int offset, void *buf, 
     int unicode, long len);
@@ -51,8 +55,11 @@ window_textgrid_t *win_textgrid_create(window_t *win)
     dwin->curx = 0;
     dwin->cury = 0;
     
-    dwin->linessize = 0;
+    dwin->planewid = 0;
+    dwin->planehgt = 0;
     dwin->lines = NULL;
+    dwin->chars = NULL;
+    dwin->attrs = NULL;
     dwin->dirtybeg = -1;
     dwin->dirtyend = -1;
     
@@ -76,14 +83,17 @@ void win_textgrid_destroy(window_textgrid_t *dwin)
     
     dwin->owner = NULL;
     if (dwin->lines) {
-        final_lines(dwin);
+        free(dwin->lines);
+        dwin->lines = NULL;
+        dwin->chars = NULL;
+        dwin->attrs = NULL;
     }
     free(dwin);
 }
 
 void win_textgrid_rearrange(window_t *win, grect_t *box)
 {
-    int ix, jx, oldval;
+    int jx, wid, hgt;
     int newwid, newhgt;
     window_textgrid_t *dwin = win->data;
     dwin->owner->bbox = *box;
@@ -92,52 +102,34 @@ void win_textgrid_rearrange(window_t *win, grect_t *box)
     newhgt = box->bottom - box->top;
     
     if (dwin->lines == NULL) {
-        dwin->linessize = (newhgt+1);
-        dwin->lines = (tgline_t *)malloc(dwin->linessize * sizeof(tgline_t));
-        if (!dwin->lines)
+        if (!resize_planes(dwin, newwid+1, newhgt+1))
             return;
-        init_lines(dwin, 0, dwin->linessize, newwid);
     }
     else {
-        if (newhgt > dwin->linessize) {
-            oldval = dwin->linessize;
-            dwin->linessize = (newhgt+1) * 2;
-            dwin->lines = (tgline_t *)realloc(dwin->lines, 
-                dwin->linessize * sizeof(tgline_t));
-            if (!dwin->lines)
+        if (newwid > dwin->planewid || newhgt > dwin->planehgt) {
+            wid = dwin->planewid;
+            if (newwid > wid)
+                wid = (newwid+1) * 2;
+            hgt = dwin->planehgt;
+            if (newhgt > hgt)
+                hgt = (newhgt+1) * 2;
+            if (!resize_planes(dwin, wid, hgt))
                 return;
-            init_lines(dwin, oldval, dwin->linessize, newwid);
         }
         if (newhgt > dwin->height) {
             for (jx=dwin->height; jx<newhgt; jx++) {
                 tgline_t *ln = &(dwin->lines[jx]);
-                for (ix=0; ix<ln->size; ix++) {
-                    ln->chars[ix] = ' ';
-                    ln->attrs[ix] = style_Normal;
-                }
-            }
-        }
-        for (jx=0; jx<newhgt; jx++) {
-            tgline_t *ln = &(dwin->lines[jx]);
-            if (newwid > ln->size) {
-                oldval = ln->size;
-                ln->size = (newwid+1) * 2;
-                ln->chars = (char *)realloc(ln->chars, 
-                    ln->size * sizeof(char));
-                ln->attrs = (unsigned char *)realloc(ln->attrs, 
-                    ln->size * sizeof(unsigned char));
-                if (!ln->chars || !ln->attrs) {
-                    dwin->lines = NULL;
-                    return;
-                }
-                for (ix=oldval; ix<ln->size; ix++) {
-                    ln->chars[ix] = ' ';
-                    ln->attrs[ix] = style_Normal;
-                }
+                memset(ln->chars, ' ', dwin->planewid);
+                memset(ln->attrs, style_Normal, dwin->planewid);
             }
         }
     }
     
+    /* The window may have moved, so what was drawn where is anybody's 
+        guess. */
+    for (jx=0; jx<dwin->planehgt; jx++)
+        dwin->lines[jx].painted = FALSE;
+    
     dwin->width = newwid;
     dwin->height = newhgt;
 
@@ -145,51 +137,71 @@ void win_textgrid_rearrange(window_t *win, grect_t *box)
     dwin->dirtyend = dwin->height;
 }
 
-static void init_lines(window_textgrid_t *dwin, int beg, int end, int linewid)
+/* Reallocate the planes as wid by hgt, which must be at least as big as
+    they are now. The old contents are kept; new space is blank. */
+static int resize_planes(window_textgrid_t *dwin, int wid, int hgt)
 {
-    int ix, jx;
-
-    for (jx=beg; jx<end; jx++) {
-        tgline_t *ln = &(dwin->lines[jx]);
-        ln->size = (linewid+1);
-        ln->dirtybeg = -1;
-        ln->dirtyend = -1;
-        ln->chars = (char *)malloc(ln->size * sizeof(char));
-        ln->attrs = (unsigned char *)malloc(ln->size * sizeof(unsigned char));
-        if (!ln->chars || !ln->size) {
-            dwin->lines = NULL;
-            return;
+    int jx;
+    long size = (long)wid * (long)hgt;
+    tgline_t *lines;
+    char *chars;
+    unsigned char *attrs;
+    
+    lines = (tgline_t *)malloc(hgt * sizeof(tgline_t) + 4 * size);
+    if (!lines)
+        return FALSE;
+    chars = (char *)(lines + hgt);
+    attrs = (unsigned char *)(chars + size);
+    memset(chars, ' ', size);
+    memset(attrs, style_Normal, size);
+    /* The painted copies are at chars + 2*size and attrs + 2*size. */
+    
+    for (jx=0; jx<hgt; jx++) {
+        tgline_t *ln = &(lines[jx]);
+        ln->chars = chars + (long)jx * wid;
+        ln->attrs = attrs + (long)jx * wid;
+        ln->paintedchars = ln->chars + 2 * size;
+        ln->paintedattrs = ln->attrs + 2 * size;
+        if (jx < dwin->planehgt) {
+            tgline_t *oldln = &(dwin->lines[jx]);
+            memcpy(ln->chars, oldln->chars, dwin->planewid);
+            memcpy(ln->attrs, oldln->attrs, dwin->planewid);
+            ln->dirtybeg = oldln->dirtybeg;
+            ln->dirtyend = oldln->dirtyend;
+            memcpy(ln->paintedchars, oldln->paintedchars, dwin->planewid);
+            memcpy(ln->paintedattrs, oldln->paintedattrs, dwin->planewid);
+            ln->painted = oldln->painted;
         }
-        for (ix=0; ix<ln->size; ix++) {
-            ln->chars[ix] = ' ';
-            ln->attrs[ix] = style_Normal;
+        else {
+            ln->dirtybeg = -1;
+            ln->dirtyend = -1;
+            ln->painted = FALSE;
         }
     }
+    
+    if (dwin->lines)
+        free(dwin->lines);
+    dwin->lines = lines;
+    dwin->chars = chars;
+    dwin->attrs = attrs;
+    dwin->planewid = wid;
+    dwin->planehgt = hgt;
+    return TRUE;
 }
 
-static void final_lines(window_textgrid_t *dwin)
+/* Return TRUE if the characters and styles of one row are exactly what
+    was last drawn on the screen. */
+static int row_unchanged(window_textgrid_t *dwin, tgline_t *ln)
 {
-    int jx;
-    
-    for (jx=0; jx<dwin->linessize; jx++) {
-        tgline_t *ln = &(dwin->lines[jx]);
-        if (ln->chars) {
-            free(ln->chars);
-            ln->chars = NULL;
-        }
-        if (ln->attrs) {
-            free(ln->attrs);
-            ln->attrs = NULL;
-        }
-    }
-    
-    free(dwin->lines);
-    dwin->lines = NULL;
+    if (!ln->painted)
+        return FALSE;
+    return (!memcmp(ln->chars, ln->paintedchars, dwin->width)
+        && !memcmp(ln->attrs, ln->paintedattrs, dwin->width));
 }
 
 static void updatetext(window_textgrid_t *dwin, int drawall)
 {
-    int ix, jx, beg, iix;
+    int ix, jx, beg;
     int orgx, orgy;
     unsigned char curattr;
     
@@ -224,28 +236,36 @@ static void updatetext(window_textgrid_t *dwin, int drawall)
         if (ln->dirtybeg == -1)
             continue;
         
+        /* Games often rewrite the whole status line every turn, without
+            changing it. If the row is the same as what's on the screen, 
+            leave it alone. */
+        if (!drawall && row_unchanged(dwin, ln)) {
+            ln->dirtybeg = -1;
+            ln->dirtyend = -1;
+            continue;
+        }
+        
         /* draw one line. */
-        move(orgy+jx, orgx+ln->dirtybeg);
+        (*gli_screen->set_pos)(orgy+jx, orgx+ln->dirtybeg);
         
         ix=ln->dirtybeg;
         while (ix<ln->dirtyend) {
-            unsigned char *ucx;
             beg = ix;
             curattr = ln->attrs[beg];
             for (ix++; ix<ln->dirtyend && ln->attrs[ix] == curattr; ix++) { }
-            attrset(win_textgrid_styleattrs[curattr]);
-            ucx = (unsigned char *)ln->chars; /* unsigned, so that addch() doesn't
-                get fed any high style bits. */
-            for (iix=beg; iix<ix; iix++) {
-                addch(ucx[iix]);
-            }
+            /* Each run of one style goes out in a single call. */
+            (*gli_screen->set_attr)(win_textgrid_styleattrs[curattr]);
+            (*gli_screen->put_string)(ln->chars+beg, ix-beg);
         }
         
         ln->dirtybeg = -1;
         ln->dirtyend = -1;
+        memcpy(ln->paintedchars, ln->chars, dwin->width);
+        memcpy(ln->paintedattrs, ln->attrs, dwin->width);
+        ln->painted = TRUE;
     }
     
-    attrset(0);
+    (*gli_screen->set_attr)(0);
     
     dwin->dirtybeg = -1;
     dwin->dirtyend = -1;
@@ -310,16 +330,73 @@ void win_textgrid_putchar(window_t *win, char ch)
         canonicalized next time a character is printed. */
 }
 
+/* Print a run of characters, which have already been converted to native.
+    This has the same effect as calling win_textgrid_putchar() on each
+    one, but copies them in a span at a time, up to the next newline or
+    the end of the row. */
+void win_textgrid_put_buffer(window_t *win, char *buf, long len)
+{
+    window_textgrid_t *dwin = win->data;
+    tgline_t *ln;
+    char *nl;
+    long lx, count;
+    
+    lx = 0;
+    while (lx < len) {
+        /* Canonicalize the cursor position, as in win_textgrid_putchar(). */
+        if (dwin->curx < 0)
+            dwin->curx = 0;
+        else if (dwin->curx >= dwin->width) {
+            dwin->curx = 0;
+            dwin->cury++;
+        }
+        if (dwin->cury < 0)
+            dwin->cury = 0;
+        else if (dwin->cury >= dwin->height)
+            return; /* outside the window */
+        
+        if (buf[lx] == '\n') {
+            dwin->cury++;
+            dwin->curx = 0;
+            lx++;
+            continue;
+        }
+        
+        count = dwin->width - dwin->curx;
+        if (count > len - lx)
+            count = len - lx;
+        nl = memchr(buf+lx, '\n', count);
+        if (nl)
+            count = nl - (buf+lx);
+        
+        ln = &(dwin->lines[dwin->cury]);
+        
+        setposdirty(dwin, ln, dwin->curx, dwin->cury);
+        setposdirty(dwin, ln, dwin->curx+(count-1), dwin->cury);
+        
+        memcpy(ln->chars+dwin->curx, buf+lx, count);
+        memset(ln->attrs+dwin->curx, win->style, count);
+        
+        dwin->curx += count;
+        lx += count;
+    }
+}
+
 void win_textgrid_clear(window_t *win)
 {
-    int ix, jx;
+    int jx;
     window_textgrid_t *dwin = win->data;
     
+    if (dwin->width == dwin->planewid) {
+        /* The rows are back to back, so clear them all at once. */
+        memset(dwin->chars, ' ', (long)dwin->width * dwin->height);
+        memset(dwin->attrs, style_Normal, (long)dwin->width * dwin->height);
+    }
     for (jx=0; jx<dwin->height; jx++) {
         tgline_t *ln = &(dwin->lines[jx]);
-        for (ix=0; ix<dwin->width; ix++) {
-            ln->chars[ix] = ' ';
-            ln->attrs[ix] = style_Normal;
+        if (dwin->width != dwin->planewid) {
+            memset(ln->chars, ' ', dwin->width);
+            memset(ln->attrs, style_Normal, dwin->width);
         }
         ln->dirtybeg = 0;
         ln->dirtyend = dwin->width;
@@ -566,6 +643,8 @@ void gcmd_grid_accept_line(window_t *win, glui32 arg)
     else
         termkey = 0;
 
+    if (pref_recordfile)
+        gli_record_line(win, inbuf, inunicode, dwin->inlen);
     gli_event_store(evtype_LineInput, win, dwin->inlen, termkey);
     win->line_request = FALSE;
     dwin->inbuf = NULL;
@@ -611,7 +690,7 @@ void gcmd_grid_insert_key(window_t *win, glui32 arg)
     dwin->curx = dwin->inorgx+dwin->incurs;
     dwin->cury = dwin->inorgy;
     
-    updatetext(dwin, FALSE);
+    /* The next update will draw it. */
 }
 
 /* Delete keys, during line input. */
@@ -671,7 +750,7 @@ void gcmd_grid_delete(window_t *win, glui32 arg)
     dwin->curx = dwin->inorgx+dwin->incurs;
     dwin->cury = dwin->inorgy;
     
-    updatetext(dwin, FALSE);
+    /* The next update will draw it. */
 }
 
 /* Cursor movement keys, during line input. */
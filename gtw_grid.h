@@ -6,19 +6,25 @@
 
 /* One line of the window. */
 typedef struct tgline_struct {
-    int size; /* this is the allocated size; only width is valid */
-    char *chars;
-    unsigned char *attrs;
+    char *chars; /* this row of the window's character plane */
+    unsigned char *attrs; /* this row of the window's style plane */
     int dirtybeg, dirtyend; /* characters [dirtybeg, dirtyend) need to be redrawn */
+    int painted; /* are paintedchars and paintedattrs valid? */
+    char *paintedchars; /* a copy of the whole row, as it was last drawn */
+    unsigned char *paintedattrs; /* on the screen */
 } tgline_t;
 
 typedef struct window_textgrid_struct {
     window_t *owner;
     
     int width, height;
-    tgline_t *lines;
-    int linessize; /* this is the allocated size of the lines array;
-        only the first height entries are valid. */
+    tgline_t *lines; /* one for each row of the planes. */
+    char *chars; /* the character plane: planehgt rows of planewid. */
+    unsigned char *attrs; /* the style plane, the same shape. */
+    /* Copies of both planes, as they were last drawn, follow them in the
+        same block of memory. */
+    int planewid, planehgt; /* this is the allocated size of the planes
+        (and the lines array); only width by height is valid. */
     
     int curx, cury; /* the window cursor position */
     
@@ -43,6 +49,7 @@ extern void win_textgrid_rearrange(window_t *win, grect_t *box);
 extern void win_textgrid_redraw(window_t *win);
 extern void win_textgrid_update(window_t *win);
 extern void win_textgrid_putchar(window_t *win, char ch);
+extern void win_textgrid_put_buffer(window_t *win, char *buf, long len);
 extern void win_textgrid_clear(window_t *win);
 extern void win_textgrid_move_cursor(window_t *win, int xpos, int ypos);
 extern void win_textgrid_place_cursor(window_t *win, int *xpos, int *ypos);
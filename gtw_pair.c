@@ -10,6 +10,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 #include "gtw_pair.h"
 
 window_pair_t *win_pair_create(window_t *win, glui32 method, window_t *key, 
@@ -24,6 +25,8 @@ window_pair_t *win_pair_create(window_t *win, glui32 method, window_t *key,
     dwin->key = key;
     dwin->keydamage = FALSE;
     dwin->size = size;
+    dwin->splitpos = 0;
+    dwin->splitwidth = 0;
     
     dwin->vertical = (dwin->dir == winmethod_Left || dwin->dir == winmethod_Right);
     dwin->backward = (dwin->dir == winmethod_Left || dwin->dir == winmethod_Above);
@@ -52,6 +55,12 @@ void win_pair_rearrange(window_t *win, grect_t *box)
     int min, diff, split, splitwid, max;
     window_t *key;
     window_t *ch1, *ch2;
+    grect_t oldbox;
+    int oldsplitpos, oldsplitwidth;
+
+    oldbox = win->bbox;
+    oldsplitpos = dwin->splitpos;
+    oldsplitwidth = dwin->splitwidth;
 
     win->bbox = *box;
     /*dwin->flat = FALSE;*/
@@ -170,49 +179,83 @@ void win_pair_rearrange(window_t *win, grect_t *box)
         }
     }
     
+    /* If neither the box nor the split has moved, the children's boxes
+        are the same as before, and nothing below here needs doing. (When
+        the split's attributes or the tree itself change, the caller sets
+        layoutdamage to force it.) */
+    if (!win->layoutdamage && gli_rect_equal(&oldbox, box)
+        && dwin->splitpos == oldsplitpos 
+        && dwin->splitwidth == oldsplitwidth)
+        return;
+    win->layoutdamage = TRUE;
+    
     gli_window_rearrange(ch1, &box1);
     gli_window_rearrange(ch2, &box2);
 }
 
-void win_pair_redraw(window_t *win)
+static void draw_border(window_t *win)
 {
     int ix;
-    window_pair_t *dwin;
-    
-    if (!win)
-        return;
-        
-    dwin = win->data;
+    window_pair_t *dwin = win->data;
 
     if (dwin->vertical) {
         if (dwin->splitwidth) {
             for (ix=win->bbox.top; ix<win->bbox.bottom; ix++) {
-                mvaddch(ix, dwin->splitpos, '|');
+                (*gli_screen->set_pos)(ix, dwin->splitpos);
+                (*gli_screen->put_char)('|');
             }
             if (win->bbox.top-1 >= 0) {
-                mvaddch(win->bbox.top-1, dwin->splitpos, '+');
+                (*gli_screen->set_pos)(win->bbox.top-1, dwin->splitpos);
+                (*gli_screen->put_char)('+');
             }
             if (win->bbox.bottom < content_box.bottom) {
-                mvaddch(win->bbox.bottom, dwin->splitpos, '+');
+                (*gli_screen->set_pos)(win->bbox.bottom, dwin->splitpos);
+                (*gli_screen->put_char)('+');
             }
         }
     }
     else {
         if (dwin->splitwidth) {
-            move(dwin->splitpos, win->bbox.left);
+            (*gli_screen->set_pos)(dwin->splitpos, win->bbox.left);
             for (ix=win->bbox.left; ix<win->bbox.right; ix++) {
-                addch('-');
+                (*gli_screen->put_char)('-');
             }
             if (win->bbox.left-1 >= 0) {
-                mvaddch(dwin->splitpos, win->bbox.left-1, '+');
+                (*gli_screen->set_pos)(dwin->splitpos, win->bbox.left-1);
+                (*gli_screen->put_char)('+');
             }
             if (win->bbox.right < content_box.right) {
-                mvaddch(dwin->splitpos, win->bbox.right, '+');
+                (*gli_screen->set_pos)(dwin->splitpos, win->bbox.right);
+                (*gli_screen->put_char)('+');
             }
         }
     }
+}
+
+void win_pair_redraw(window_t *win)
+{
+    window_pair_t *dwin;
+    
+    if (!win)
+        return;
+        
+    dwin = win->data;
+    draw_border(win);
     
     gli_window_redraw(dwin->child1);
     gli_window_redraw(dwin->child2);
 }
 
+/* Draw the border again (in case a child's corner was drawn over it), but
+    only the children which have been laid out anew. */
+void win_pair_redraw_damaged(window_t *win)
+{
+    window_pair_t *dwin = win->data;
+    
+    win->layoutdamage = FALSE;
+    draw_border(win);
+    
+    gli_window_redraw_damaged(dwin->child1);
+    gli_window_redraw_damaged(dwin->child2);
+}
+
@@ -15,6 +15,7 @@
 #include <curses.h>
 #include "glk.h"
 #include "glkterm.h"
+#include "gtscreen.h"
 #include "gtw_pair.h"
 #include "gtw_blnk.h"
 #include "gtw_grid.h"
@@ -23,10 +24,6 @@
 /* Linked list of all windows */
 static window_t *gli_windowlist = NULL; 
 
-/* For use by gli_print_spaces() */
-#define NUMSPACES (16)
-static char spacebuffer[NUMSPACES+1];
-
 window_t *gli_rootwin = NULL; /* The topmost window. */
 window_t *gli_focuswin = NULL; /* The window selected by the player. 
     (This has nothing to do with the "current output stream", which is
@@ -62,11 +59,6 @@ void gli_initialize_windows()
     gli_rootwin = NULL;
     gli_focuswin = NULL;
     
-    /* Build a convenient array of spaces. */
-    for (ix=0; ix<NUMSPACES; ix++)
-        spacebuffer[ix] = ' ';
-    spacebuffer[NUMSPACES] = '\0';
-    
     /* Create the curses.h attribute values for each style. */
     for (ix=0; ix<style_NUMSTYLES; ix++) {
         chtype val = 0;
@@ -105,20 +97,6 @@ void gli_initialize_windows()
     gli_windows_redraw();
 }
 
-/* Set up all the curses parameters. This is called from main() -- 
-    before gli_initialize_windows, actually -- and also when curses
-    is reinitialized for a screen-size change. */
-void gli_setup_curses()
-{
-    initscr();
-    cbreak();
-    noecho();
-    nonl(); 
-    intrflush(stdscr, FALSE); 
-    keypad(stdscr, TRUE);
-    scrollok(stdscr, FALSE);
-}
-
 #ifdef OPT_USE_SIGNALS
 
 /* Signal handler for SIGCONT. */
@@ -126,12 +104,14 @@ static void gli_sig_resume(int val)
 {
     signal(SIGCONT, &gli_sig_resume);
     just_resumed = TRUE;
+    gli_event_wake();
 }
 
 /* Signal handler for SIGINT. */
 static void gli_sig_interrupt(int val)
 {
     just_killed = TRUE;
+    gli_event_wake();
 }
 
 #ifdef OPT_WINCHANGED_SIGNAL
@@ -139,13 +119,11 @@ static void gli_sig_interrupt(int val)
 /* Signal handler for SIGWINCH. */
 static void gli_sig_winsize(int val)
 {
-    endwin();
-
-    newterm(getenv("TERM"), stdout, stdin);
-    gli_setup_curses();
+    (*gli_screen->reset)();
     gli_set_halfdelay();
 
     screen_size_changed = TRUE;
+    gli_event_wake();
     signal(SIGWINCH, &gli_sig_winsize);
 }
 
@@ -163,7 +141,7 @@ void gli_fast_exit()
     }
 
     gli_streams_close_all();
-    endwin();
+    (*gli_screen->shutdown)();
     putchar('\n');
     exit(0);
 }
@@ -172,18 +150,15 @@ static void compute_content_box()
 {
     /* Set content_box to the entire screen, although one could also
         leave a border for messages or decoration. This is the only
-        place where COLS and LINES are checked. All the rest of the
+        place where the screen size is checked. All the rest of the
         layout code uses content_box. */
     int width, height;
     
+    (*gli_screen->get_size)(&width, &height);
     if (pref_screenwidth)
         width = pref_screenwidth;
-    else
-        width = COLS;
     if (pref_screenheight)
         height = pref_screenheight;
-    else
-        height = LINES;
     
     content_box.left = 0;
     content_box.top = 0;
@@ -206,6 +181,7 @@ window_t *gli_new_window(glui32 type, glui32 rock)
     
     win->parent = NULL; /* for now */
     win->data = NULL; /* for now */
+    win->layoutdamage = TRUE; /* never drawn */
     win->char_request = FALSE;
     win->line_request = FALSE;
     win->line_request_uni = FALSE;
@@ -371,8 +347,8 @@ winid_t glk_window_open(winid_t splitwin, glui32 method, glui32 size,
         }
         
         gli_window_rearrange(pairwin, &box);
-        /* redraw the new pairwin and all its contents */
-        gli_window_redraw(pairwin);
+        /* redraw the windows which the new pairwin squeezed together */
+        gli_window_redraw_damaged(gli_rootwin);
     }
     
     return newwin;
@@ -386,6 +362,8 @@ static void gli_window_close(window_t *win, int recurse)
         gli_focuswin = NULL;
     }
     
+    gli_event_forget_window(win);
+    
     for (wx=win->parent; wx; wx=wx->parent) {
         if (wx->type == wintype_Pair) {
             window_pair_t *dwx = wx->data;
@@ -515,14 +493,19 @@ void glk_window_close(window_t *win, stream_result_t *result)
         }
         
         if (keydamage_flag) {
+            /* Lay out the tree again from the top. The pairs above sibwin
+                have to be gone through even if their own geometry hasn't
+                changed, since one of their descendants is gone; other
+                subtrees are left alone unless their boxes change. */
+            for (wx=sibwin; wx; wx=wx->parent)
+                wx->layoutdamage = TRUE;
             box = content_box;
             gli_window_rearrange(gli_rootwin, &box);
-            gli_windows_redraw();
         }
         else {
             gli_window_rearrange(sibwin, &box);
-            gli_window_redraw(sibwin);
         }
+        gli_window_redraw_damaged(gli_rootwin);
     }
 }
 
@@ -634,8 +617,9 @@ void glk_window_set_arrangement(window_t *win, glui32 method, glui32 size,
     dwin->vertical = (dwin->dir == winmethod_Left || dwin->dir == winmethod_Right);
     dwin->backward = (dwin->dir == winmethod_Left || dwin->dir == winmethod_Above);
     
+    win->layoutdamage = TRUE;
     gli_window_rearrange(win, &box);
-    gli_window_redraw(win);
+    gli_window_redraw_damaged(gli_rootwin);
 }
 
 winid_t glk_window_iterate(winid_t win, glui32 *rock)
@@ -833,8 +817,16 @@ void gli_windows_unechostream(stream_t *str)
 /* Some trivial switch functions which make up for the fact that we're not
     doing this in C++. */
 
+/* Pair windows decide for themselves whether their children need
+    rearranging; any other window whose box hasn't changed is left alone. */
 void gli_window_rearrange(window_t *win, grect_t *box)
 {
+    if (win->type != wintype_Pair) {
+        if (!win->layoutdamage && gli_rect_equal(&win->bbox, box))
+            return;
+        win->layoutdamage = TRUE;
+    }
+
     switch (win->type) {
         case wintype_Blank:
             win_blank_rearrange(win, box);
@@ -869,6 +861,8 @@ void gli_windows_update()
 
 void gli_window_redraw(window_t *win)
 {
+    win->layoutdamage = FALSE;
+
     if (win->bbox.left >= win->bbox.right 
         || win->bbox.top >= win->bbox.bottom)
         return;
@@ -889,6 +883,26 @@ void gli_window_redraw(window_t *win)
     }
 }
 
+/* Redraw the windows in this subtree which have been laid out anew since
+    they were last drawn, and the borders of every pair window in it. (The
+    borders are cheap, and the virtual screen sends only the cells which
+    actually change to the terminal.) Other windows are left as they are.
+   This is normally called on gli_rootwin, because the corners of a pair
+    window's border are drawn on the borders of the pairs above it. */
+void gli_window_redraw_damaged(window_t *win)
+{
+    if (win->bbox.left >= win->bbox.right 
+        || win->bbox.top >= win->bbox.bottom) {
+        win->layoutdamage = FALSE;
+        return;
+    }
+
+    if (win->type == wintype_Pair)
+        win_pair_redraw_damaged(win);
+    else if (win->layoutdamage)
+        gli_window_redraw(win);
+}
+
 void gli_windows_redraw()
 {
     int ix, jx;
@@ -899,13 +913,13 @@ void gli_windows_redraw()
     }
     else {
         /* There are no windows at all. */
-        clear();
+        (*gli_screen->clear_all)();
         ix = (content_box.left+content_box.right) / 2 - 7;
         if (ix < 0)
             ix = 0;
         jx = (content_box.top+content_box.bottom) / 2;
-        move(jx, ix);
-        addstr("Please wait...");
+        (*gli_screen->set_pos)(jx, ix);
+        (*gli_screen->put_string)("Please wait...", 14);
     }
 }
 
@@ -937,10 +951,11 @@ void gli_windows_place_cursor()
             default:
                 break;
         }
-        move(gli_focuswin->bbox.top + ypos, gli_focuswin->bbox.left + xpos);
+        (*gli_screen->set_pos)(gli_focuswin->bbox.top + ypos, 
+            gli_focuswin->bbox.left + xpos);
     }
     else {
-        move(content_box.bottom-1, content_box.right-1);
+        (*gli_screen->set_pos)(content_box.bottom-1, content_box.right-1);
     }
 }
 
@@ -957,6 +972,26 @@ void gli_windows_set_paging(int forcetoend)
     }
 }
 
+/* Do a little background work in each window that has some. This is 
+    called when glk_select() is waiting for input. Returns TRUE if there's
+    more to do. */
+int gli_windows_idle_work()
+{
+    window_t *win;
+    int more = FALSE;
+    
+    for (win=gli_windowlist; win; win=win->next) {
+        switch (win->type) {
+            case wintype_TextBuffer:
+                if (win_textbuffer_idle_work(win))
+                    more = TRUE;
+                break;
+        }
+    }
+    
+    return more;
+}
+
 void gli_windows_trim_buffers()
 {
     window_t *win;
@@ -1192,6 +1227,59 @@ void gli_window_put_char(window_t *win, char ch)
     }
 }
 
+/* Hand a chunk of converted text to the window. */
+static void gli_window_put_native(window_t *win, char *buf, int len)
+{
+    switch (win->type) {
+        case wintype_TextBuffer:
+            win_textbuffer_put_buffer(win, buf, len);
+            break;
+        case wintype_TextGrid:
+            win_textgrid_put_buffer(win, buf, len);
+            break;
+    }
+}
+
+/* Print a whole buffer of characters. This does the same conversion as
+    gli_window_put_char(), but hands text windows the converted 
+    text in large chunks. */
+void gli_window_put_buffer(window_t *win, char *buf, glui32 len)
+{
+    char tmpbuf[256];
+    int tmplen;
+    glui32 lx;
+    unsigned char ch;
+    
+    if (win->type != wintype_TextBuffer && win->type != wintype_TextGrid)
+        return;
+    
+    tmplen = 0;
+    for (lx=0; lx<len; lx++) {
+        /* leave room for an ASCII equivalent, which is a few characters 
+            at most. */
+        if (tmplen + 16 > (int)sizeof(tmpbuf)) {
+            gli_window_put_native(win, tmpbuf, tmplen);
+            tmplen = 0;
+        }
+        ch = buf[lx];
+        if (!char_printable_table[ch]) {
+            char *altstr = gli_ascii_equivalent(ch);
+            while (*altstr) {
+                tmpbuf[tmplen++] = *altstr;
+                altstr++;
+            }
+            continue;
+        }
+#ifndef OPT_NATIVE_LATIN_1  
+        ch = char_to_native_table[ch];
+#endif /* OPT_NATIVE_LATIN_1 */
+        tmpbuf[tmplen++] = ch;
+    }
+    
+    if (tmplen)
+        gli_window_put_native(win, tmpbuf, tmplen);
+}
+
 void glk_window_clear(window_t *win)
 {
     if (!win) {
@@ -1231,18 +1319,6 @@ void glk_window_move_cursor(window_t *win, glui32 xpos, glui32 ypos)
     }
 }
 
-void gli_print_spaces(int len)
-{
-    while (len >= NUMSPACES) {
-        addstr(spacebuffer);
-        len -= NUMSPACES;
-    }
-    
-    if (len > 0) {
-        addstr(&(spacebuffer[NUMSPACES - len]));
-    }
-}
-
 #ifdef GLK_MODULE_LINE_ECHO
 
 void glk_set_echo_line_event(window_t *win, glui32 val)
@@ -1307,10 +1383,10 @@ void gcmd_win_change_focus(window_t *win, glui32 arg)
 
 void gcmd_win_refresh(window_t *win, glui32 arg)
 {
-    clear();
+    (*gli_screen->clear_all)();
     gli_windows_redraw();
     gli_msgline_redraw();
-    wrefresh(curscr);
+    (*gli_screen->flush)(TRUE);
 }
 
 #ifdef GLK_MODULE_IMAGE
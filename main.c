@@ -13,6 +13,7 @@
 #include "glk.h"
 #include "glkterm.h"
 #include "glkstart.h"
+#include "gtscreen.h"
 
 /* Declarations of preferences flags. */
 int pref_printversion = FALSE;
@@ -23,14 +24,35 @@ int pref_reverse_textgrids = FALSE;
 int pref_override_window_borders = FALSE;
 int pref_window_borders = FALSE;
 int pref_precise_timing = FALSE;
+int pref_max_refresh = 0;
+int pref_resize_delay = 200;
 int pref_historylen = 20;
+char *pref_historyfile = NULL;
+char *pref_recordfile = NULL;
+char *pref_replayfile = NULL;
+int pref_scrollback = 5000;
+int pref_lazy_layout = TRUE;
+#ifdef OPT_LAYOUT_THREADS
+int pref_layout_threads = 1;
+#endif /* OPT_LAYOUT_THREADS */
+#ifdef OPT_SCROLLBACK_SPILL
+int pref_scrollback_spill = TRUE;
+#endif /* OPT_SCROLLBACK_SPILL */
 int pref_prompt_defaults = TRUE;
+int pref_headless = FALSE;
+#ifdef OPT_DIRECT_SCREEN
+int pref_direct_screen = FALSE;
+#endif /* OPT_DIRECT_SCREEN */
 
 /* Some constants for my wacky little command-line option parser. */
 #define ex_Void (0)
 #define ex_Int (1)
 #define ex_Bool (2)
 
+/* The smallest -scrollback allowed: a couple of screens' worth of text, so
+    that trimming doesn't eat what the player is reading. */
+#define MIN_SCROLLBACK (4000)
+
 static int errflag = FALSE;
 static int inittime = FALSE;
 
@@ -155,6 +177,58 @@ int main(int argc, char *argv[])
             pref_historylen = val;
         else if (extract_value(argc, argv, "hl", ex_Int, &ix, &val, 20))
             pref_historylen = val;
+        else if (!strcmp(argv[ix], "-historyfile")) {
+            if (ix+1 >= argc) {
+                printf("%s: %s must be followed by a file name\n", 
+                    argv[0], argv[ix]);
+                errflag = TRUE;
+            }
+            else {
+                ix++;
+                pref_historyfile = argv[ix];
+            }
+        }
+        else if (!strcmp(argv[ix], "-record")) {
+            if (ix+1 >= argc) {
+                printf("%s: %s must be followed by a file name\n", 
+                    argv[0], argv[ix]);
+                errflag = TRUE;
+            }
+            else {
+                ix++;
+                pref_recordfile = argv[ix];
+            }
+        }
+        else if (!strcmp(argv[ix], "-replay")) {
+            if (ix+1 >= argc) {
+                printf("%s: %s must be followed by a file name\n", 
+                    argv[0], argv[ix]);
+                errflag = TRUE;
+            }
+            else {
+                ix++;
+                pref_replayfile = argv[ix];
+            }
+        }
+        else if (extract_value(argc, argv, "scrollback", ex_Int, &ix, &val, 5000)
+            || extract_value(argc, argv, "sb", ex_Int, &ix, &val, 5000)) {
+            if (val < MIN_SCROLLBACK) {
+                printf("%s: -scrollback must be at least %d\n", 
+                    argv[0], MIN_SCROLLBACK);
+                errflag = TRUE;
+            }
+            pref_scrollback = val;
+        }
+#ifdef OPT_SCROLLBACK_SPILL
+        else if (extract_value(argc, argv, "spill", ex_Bool, &ix, &val, pref_scrollback_spill))
+            pref_scrollback_spill = val;
+#endif /* OPT_SCROLLBACK_SPILL */
+        else if (extract_value(argc, argv, "headless", ex_Bool, &ix, &val, pref_headless))
+            pref_headless = val;
+#ifdef OPT_DIRECT_SCREEN
+        else if (extract_value(argc, argv, "direct", ex_Bool, &ix, &val, pref_direct_screen))
+            pref_direct_screen = val;
+#endif /* OPT_DIRECT_SCREEN */
         else if (extract_value(argc, argv, "width", ex_Int, &ix, &val, 80))
             pref_screenwidth = val;
         else if (extract_value(argc, argv, "w", ex_Int, &ix, &val, 80))
@@ -171,11 +245,36 @@ int main(int argc, char *argv[])
             pref_window_borders = val;
             pref_override_window_borders = TRUE;
         }
+        else if (extract_value(argc, argv, "lazy", ex_Bool, &ix, &val, pref_lazy_layout))
+            pref_lazy_layout = val;
+#ifdef OPT_LAYOUT_THREADS
+        else if (extract_value(argc, argv, "threads", ex_Int, &ix, &val, 1)) {
+            if (val < 1) {
+                printf("%s: -threads must be at least 1\n", argv[0]);
+                errflag = TRUE;
+            }
+            pref_layout_threads = val;
+        }
+#endif /* OPT_LAYOUT_THREADS */
         else if (extract_value(argc, argv, "defprompt", ex_Bool, &ix, &val, pref_prompt_defaults))
             pref_prompt_defaults = val;
 #ifdef OPT_TIMED_INPUT
         else if (extract_value(argc, argv, "precise", ex_Bool, &ix, &val, pref_precise_timing))
             pref_precise_timing = val;
+        else if (extract_value(argc, argv, "fps", ex_Int, &ix, &val, 0)) {
+            if (val < 0) {
+                printf("%s: -fps must not be negative\n", argv[0]);
+                errflag = TRUE;
+            }
+            pref_max_refresh = val;
+        }
+        else if (extract_value(argc, argv, "resizedelay", ex_Int, &ix, &val, 200)) {
+            if (val < 0) {
+                printf("%s: -resizedelay must not be negative\n", argv[0]);
+                errflag = TRUE;
+            }
+            pref_resize_delay = val;
+        }
 #endif /* !OPT_TIMED_INPUT */
         else {
             printf("%s: unknown option: %s\n", argv[0], argv[ix]);
@@ -208,11 +307,28 @@ int main(int argc, char *argv[])
         printf("  -height NUM: manual screen height (ditto)\n");
         printf("  -ml BOOL: use message line (default 'yes')\n");
         printf("  -historylen NUM: length of command history (default 20)\n");
+        printf("  -historyfile FILE: save command history in this file, and load it at startup\n");
+        printf("  -scrollback NUM: characters of text to keep in memory for each window (default 5000, at least 4000)\n");
+#ifdef OPT_SCROLLBACK_SPILL
+        printf("  -spill BOOL: save older text in a temporary file, for scrolling back (default 'yes')\n");
+#endif /* OPT_SCROLLBACK_SPILL */
         printf("  -revgrid BOOL: reverse text in grid (status) windows (default 'no')\n");
         printf("  -border BOOL: force borders/no borders between windows\n");
+        printf("  -lazy BOOL: after a resize, lay out off-screen text in the background (default 'yes')\n");
+#ifdef OPT_LAYOUT_THREADS
+        printf("  -threads NUM: number of threads to lay out text with (default 1)\n");
+#endif /* OPT_LAYOUT_THREADS */
         printf("  -defprompt BOOL: provide defaults for file prompts (default 'yes')\n");
+        printf("  -headless BOOL: draw into memory instead of the terminal, and read keys from standard input (default 'no')\n");
+        printf("  -record FILE: save every event the game gets in this file\n");
+        printf("  -replay FILE: play back the events saved by -record, as fast as possible, headless\n");
+#ifdef OPT_DIRECT_SCREEN
+        printf("  -direct BOOL: draw with ANSI escape sequences instead of curses (default 'no')\n");
+#endif /* OPT_DIRECT_SCREEN */
 #ifdef OPT_TIMED_INPUT
         printf("  -precise BOOL: more precise timing for timed input (burns more CPU time) (default 'no')\n");
+        printf("  -fps NUM: most screen updates per second for games that poll for events (default 0, no limit)\n");
+        printf("  -resizedelay NUM: milliseconds to wait for the terminal to stop changing size before rearranging windows (default 200)\n");
 #endif /* !OPT_TIMED_INPUT */
         printf("  -version: display Glk library version\n");
         printf("  -help: display this list\n");
@@ -227,9 +343,22 @@ int main(int argc, char *argv[])
         return 1;
     }
     
-    /* We now start up curses. From now on, the program must exit through
-        glk_exit(), so that endwin() is called. */
-    gli_setup_curses();
+    if (pref_recordfile && pref_replayfile) {
+        printf("%s: -record and -replay cannot be used together\n", argv[0]);
+        return 1;
+    }
+    if (!gli_initialize_record(argv[0]))
+        return 1;
+    
+    /* We now start up the screen (normally curses). From now on, the 
+        program must exit through glk_exit(), so that endwin() is called. */
+    if (pref_headless)
+        gli_screen = &gli_screen_headless;
+#ifdef OPT_DIRECT_SCREEN
+    else if (pref_direct_screen)
+        gli_screen = &gli_screen_direct;
+#endif /* OPT_DIRECT_SCREEN */
+    (*gli_screen->setup)();
     
     /* Initialize things. */
     gli_initialize_misc();